@@ -0,0 +1,110 @@
+#ifndef BLOOM_FILTER_H_
+#define BLOOM_FILTER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "key_hash.h"
+
+// Blocked Bloom filter used to short-circuit negative lookups.
+// Every key maps to a single 64-byte block, so a query costs one cache miss
+// no matter how many bits are probed. Keys without std::hash never enable
+// the filter.
+template <typename K>
+class BloomFilter {
+ public:
+  // Size the filter for @capacity keys and forget every added key
+  void Reset(unsigned int capacity);
+  // Release the filter, after which every key may be contained
+  void Clear();
+  // Return whether the filter is allocated
+  bool Enabled() const;
+  // Return the number of bytes held by the filter
+  size_t Bytes() const;
+  // Record @key in the filter
+  void Add(const K &key);
+  // Return false only if @key was never added
+  bool MayContain(const K &key) const;
+
+ private:
+  struct alignas(64) Block {
+    uint64_t words[8];
+  };
+  // ~1% false positives with 10 bits per key and 6 probes per block
+  static constexpr unsigned int kBitsPerKey = 10;
+  static constexpr unsigned int kProbes = 6;
+  std::vector<Block> blocks;
+
+  static uint64_t Mix(uint64_t h);
+  uint64_t BlockOf(uint64_t h) const;
+};
+
+template <typename K>
+void BloomFilter<K>::Reset(unsigned int capacity) {
+  if (!IsHashable<K>::value)
+    return;
+  uint64_t bits = static_cast<uint64_t>(capacity) * kBitsPerKey;
+  blocks.assign(bits / 512 + 1, Block{});
+}
+
+template <typename K>
+void BloomFilter<K>::Clear() {
+  blocks.clear();
+  blocks.shrink_to_fit();
+}
+
+template <typename K>
+bool BloomFilter<K>::Enabled() const {
+  return !blocks.empty();
+}
+
+template <typename K>
+size_t BloomFilter<K>::Bytes() const {
+  return blocks.size() * sizeof(Block);
+}
+
+template <typename K>
+uint64_t BloomFilter<K>::Mix(uint64_t h) {
+  // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+template <typename K>
+uint64_t BloomFilter<K>::BlockOf(uint64_t h) const {
+  // Map the high 32 bits onto [0, blocks.size()) without a division
+  return ((h >> 32) * blocks.size()) >> 32;
+}
+
+template <typename K>
+void BloomFilter<K>::Add(const K &key) {
+  if (blocks.empty()) return;
+  uint64_t h = HashKey(key);
+  Block &block = blocks[BlockOf(h)];
+  // Each probe takes 9 bits of a rehash: 3 select the word, 6 the bit
+  uint64_t g = Mix(h);
+  for (unsigned int i = 0; i < kProbes; ++i) {
+    unsigned int probe = (g >> (i * 9)) & 511;
+    block.words[probe >> 6] |= uint64_t(1) << (probe & 63);
+  }
+}
+
+template <typename K>
+bool BloomFilter<K>::MayContain(const K &key) const {
+  if (blocks.empty()) return true;
+  uint64_t h = HashKey(key);
+  const Block &block = blocks[BlockOf(h)];
+  uint64_t g = Mix(h);
+  for (unsigned int i = 0; i < kProbes; ++i) {
+    unsigned int probe = (g >> (i * 9)) & 511;
+    if (!(block.words[probe >> 6] & (uint64_t(1) << (probe & 63))))
+      return false;
+  }
+  return true;
+}
+
+#endif  // BLOOM_FILTER_H_
@@ -0,0 +1,89 @@
+#ifndef CHANGE_LOG_H_
+#define CHANGE_LOG_H_
+
+#include <vector>
+
+// Kind of change to the contents of a tree
+enum class ChangeOp { kInsert, kRemove };
+
+// Bounded log of the most recent changes to a tree, kept in a ring buffer.
+// Every change bumps the tree's version by one, so the retained changes hold
+// consecutive versions and the change following any version is found in
+// O(1). Older changes are dropped once the log is full.
+template <typename K, typename V>
+class ChangeLog {
+ public:
+  struct Change {
+    unsigned long long version;
+    ChangeOp op;
+    K key;
+    V value;
+  };
+
+  // Keep up to @capacity changes made after @version, 0 keeps none
+  void Reset(unsigned int capacity, unsigned long long version);
+  // Record the change that brought the tree to @version
+  void Record(unsigned long long version, ChangeOp op,
+              const K &key, const V &value);
+  // Forget every change up to @version, e.g. when the tree was cleared
+  void Truncate(unsigned long long version);
+  // Append the changes made after @version to @changes, return false when
+  // some of them were dropped
+  bool Since(unsigned long long version, std::vector<Change> *changes) const;
+
+ private:
+  std::vector<Change> changes;
+  unsigned int capacity = 0;
+  // Index of the oldest change in @changes
+  unsigned int head = 0;
+  // Latest version whose change is no longer retained
+  unsigned long long dropped = 0;
+};
+
+template <typename K, typename V>
+void ChangeLog<K, V>::Reset(unsigned int capacity,
+                            unsigned long long version) {
+  changes.clear();
+  changes.shrink_to_fit();
+  changes.reserve(capacity);
+  this->capacity = capacity;
+  head = 0;
+  dropped = version;
+}
+
+template <typename K, typename V>
+void ChangeLog<K, V>::Record(unsigned long long version, ChangeOp op,
+                             const K &key, const V &value) {
+  if (capacity == 0) {
+    dropped = version;
+  } else if (changes.size() < capacity) {
+    changes.push_back(Change{version, op, key, value});
+  } else {
+    // Overwrite the oldest change
+    changes[head] = Change{version, op, key, value};
+    head = (head + 1) % capacity;
+    dropped++;
+  }
+}
+
+template <typename K, typename V>
+void ChangeLog<K, V>::Truncate(unsigned long long version) {
+  changes.clear();
+  head = 0;
+  dropped = version;
+}
+
+template <typename K, typename V>
+bool ChangeLog<K, V>::Since(unsigned long long version,
+                            std::vector<Change> *changes) const {
+  unsigned long long latest = dropped + this->changes.size();
+  if (version < dropped || version > latest)
+    return false;
+  for (unsigned long long v = version + 1; v <= latest; ++v) {
+    unsigned int i = (head + (v - dropped - 1)) % capacity;
+    changes->push_back(this->changes[i]);
+  }
+  return true;
+}
+
+#endif  // CHANGE_LOG_H_
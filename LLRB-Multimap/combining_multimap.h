@@ -0,0 +1,198 @@
+#ifndef COMBINING_MULTIMAP_H_
+#define COMBINING_MULTIMAP_H_
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "change_log.h"
+#include "multimap.h"
+
+// Multimap front end for many producer threads. Producers push their
+// requests onto lock-free stacks, sharded by thread, and get a future back.
+// Whichever producer wins the combining flag drains every stack, sorts the
+// batch by key and applies it to the tree in one pass, so the tree only
+// changes hands between combiners instead of between every producer. A
+// combiner sweeps the stacks a bounded number of times, producers that lose
+// the flag wait until a combiner applied their request or take the flag
+// over, so every call returns even under sustained load.
+// Reads are served concurrently under a shared lock.
+template <typename K, typename V>
+class CombiningMultimap {
+ public:
+  CombiningMultimap() = default;
+  CombiningMultimap(const CombiningMultimap&) = delete;
+  CombiningMultimap& operator=(const CombiningMultimap&) = delete;
+  ~CombiningMultimap();
+
+  // Insert @key through the combiner, return once it is applied with a
+  // future holding the exception it threw, if any
+  std::future<void> Insert(const K &key, const V &value);
+  // Remove the first value of @key through the combiner
+  std::future<void> Remove(const K &key);
+  // Apply every request queued before the call
+  void Flush();
+
+  // Return size of tree, not counting requests still queued
+  unsigned int Size();
+  // Return first value associated to @key
+  V Get(const K &key);
+  // Return whether @key is found in tree
+  bool Contains(const K &key);
+  // Return a copy of tree
+  Multimap<K, V> Snapshot();
+
+ private:
+  struct Request {
+    ChangeOp op;
+    K key;
+    V value;
+    std::promise<void> done;
+    Request *next;
+    // Set once the combiner no longer touches the request, which lives on
+    // the stack of its producer
+    std::atomic<bool> applied{false};
+  };
+  // Stack heads live on their own cache lines, producers on different
+  // shards never contend
+  struct alignas(64) Shard {
+    std::atomic<Request*> head{nullptr};
+  };
+  static constexpr unsigned int kShards = 16;
+  // Sweeps of the stacks per acquisition of the combining flag
+  static constexpr unsigned int kMaxSweeps = 4;
+  Shard shards[kShards];
+  std::atomic<bool> combining{false};
+  // Held exclusively by the combiner while it applies a batch
+  std::shared_mutex lock;
+  Multimap<K, V> tree;
+
+  std::future<void> Push(Request *request);
+  void Combine();
+  bool Drain();
+};
+
+template <typename K, typename V>
+CombiningMultimap<K, V>::~CombiningMultimap() {
+  Flush();
+}
+
+template <typename K, typename V>
+std::future<void> CombiningMultimap<K, V>::Insert(const K &key,
+                                                  const V &value) {
+  Request request{ChangeOp::kInsert, key, value, {}, nullptr};
+  return Push(&request);
+}
+
+template <typename K, typename V>
+std::future<void> CombiningMultimap<K, V>::Remove(const K &key) {
+  Request request{ChangeOp::kRemove, key, V(), {}, nullptr};
+  return Push(&request);
+}
+
+template <typename K, typename V>
+std::future<void> CombiningMultimap<K, V>::Push(Request *request) {
+  std::future<void> done = request->done.get_future();
+  // A thread always pushes to the same shard, so its requests stay ordered
+  size_t hash = std::hash<std::thread::id>()(std::this_thread::get_id());
+  std::atomic<Request*> &head = shards[hash % kShards].head;
+  request->next = head.load(std::memory_order_relaxed);
+  while (!head.compare_exchange_weak(request->next, request)) {}
+  // The current combiner picks the request up in its next sweep, unless it
+  // runs out of sweeps first and hands the flag over
+  while (!request->applied.load(std::memory_order_acquire)) {
+    if (combining.exchange(true)) {
+      std::this_thread::yield();
+      continue;
+    }
+    Combine();
+    combining.store(false);
+  }
+  return done;
+}
+
+template <typename K, typename V>
+void CombiningMultimap<K, V>::Flush() {
+  // Once we hold the flag, every earlier combiner has applied its batch
+  while (combining.exchange(true))
+    std::this_thread::yield();
+  // One sweep picks up every request pushed before the call, later ones
+  // are applied by their own producers
+  Drain();
+  combining.store(false);
+}
+
+template <typename K, typename V>
+void CombiningMultimap<K, V>::Combine() {
+  // Requests pushed during the sweeps are picked up by further sweeps, up to
+  // a bound, so that the combiner's own call returns
+  for (unsigned int sweep = 0; sweep < kMaxSweeps && Drain(); ++sweep) {}
+}
+
+template <typename K, typename V>
+bool CombiningMultimap<K, V>::Drain() {
+  std::vector<Request*> batch;
+  for (auto &shard : shards) {
+    // Stacks pop newest first, restore the order of each thread
+    size_t first = batch.size();
+    for (Request *r = shard.head.exchange(nullptr); r; r = r->next)
+      batch.push_back(r);
+    std::reverse(batch.begin() + first, batch.end());
+  }
+  if (batch.empty())
+    return false;
+
+  // Sorted keys let InsertHint() resume from the previous insertion point
+  std::stable_sort(batch.begin(), batch.end(),
+                   [](const Request *a, const Request *b) {
+                     return a->key < b->key;
+                   });
+  {
+    std::unique_lock<std::shared_mutex> guard(lock);
+    for (Request *r : batch) {
+      try {
+        if (r->op == ChangeOp::kInsert)
+          tree.InsertHint(r->key, r->value);
+        else
+          tree.Remove(r->key);
+        r->done.set_value();
+      } catch (...) {
+        r->done.set_exception(std::current_exception());
+      }
+      r->applied.store(true, std::memory_order_release);
+    }
+  }
+  return true;
+}
+
+template <typename K, typename V>
+unsigned int CombiningMultimap<K, V>::Size() {
+  std::shared_lock<std::shared_mutex> guard(lock);
+  return tree.Size();
+}
+
+template <typename K, typename V>
+V CombiningMultimap<K, V>::Get(const K &key) {
+  std::shared_lock<std::shared_mutex> guard(lock);
+  return tree.Get(key);
+}
+
+template <typename K, typename V>
+bool CombiningMultimap<K, V>::Contains(const K &key) {
+  std::shared_lock<std::shared_mutex> guard(lock);
+  return tree.Contains(key);
+}
+
+template <typename K, typename V>
+Multimap<K, V> CombiningMultimap<K, V>::Snapshot() {
+  std::shared_lock<std::shared_mutex> guard(lock);
+  return tree.Clone();
+}
+
+#endif  // COMBINING_MULTIMAP_H_
@@ -0,0 +1,141 @@
+#ifndef HOT_KEY_CACHE_H_
+#define HOT_KEY_CACHE_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "key_hash.h"
+
+// Set-associative cache from keys to the tree nodes holding them, so that
+// lookups of hot keys cost one hash probe instead of a descent. Each set
+// fills one 64-byte line with the hashes of its keys and their nodes, most
+// frequently hit first. The tree must Erase() the key of every node it frees,
+// moves or removes. Keys without std::hash never enable the cache.
+template <typename K, typename Node>
+class HotKeyCache {
+ public:
+  // Size the cache for about @entries nodes and forget every cached node
+  void Reset(unsigned int entries);
+  // Release the cache
+  void Clear();
+  // Return whether the cache is allocated
+  bool Enabled() const;
+  // Forget every cached node but keep the cache allocated
+  void Invalidate();
+  // Return the node holding @key, nullptr if it is not cached
+  Node* Find(const K &key);
+  // Cache @n as the node holding @key
+  void Put(const K &key, Node *n);
+  // Forget the node holding @key
+  void Erase(const K &key);
+  // Return the number of lookups that found or missed their key
+  unsigned long long Hits() const;
+  unsigned long long Misses() const;
+
+ private:
+  static constexpr unsigned int kWays = 4;
+  struct alignas(64) Set {
+    uint64_t hashes[kWays];
+    Node *nodes[kWays];
+  };
+  std::vector<Set> sets;
+  unsigned long long hits = 0;
+  unsigned long long misses = 0;
+
+  Set& SetOf(uint64_t h);
+};
+
+template <typename K, typename Node>
+void HotKeyCache<K, Node>::Reset(unsigned int entries) {
+  if (!IsHashable<K>::value)
+    return;
+  // Round the number of sets up to a power of two
+  size_t count = 1;
+  while (count * kWays < entries)
+    count *= 2;
+  sets.assign(count, Set{});
+}
+
+template <typename K, typename Node>
+void HotKeyCache<K, Node>::Clear() {
+  sets.clear();
+  sets.shrink_to_fit();
+}
+
+template <typename K, typename Node>
+bool HotKeyCache<K, Node>::Enabled() const {
+  return !sets.empty();
+}
+
+template <typename K, typename Node>
+void HotKeyCache<K, Node>::Invalidate() {
+  sets.assign(sets.size(), Set{});
+}
+
+template <typename K, typename Node>
+typename HotKeyCache<K, Node>::Set& HotKeyCache<K, Node>::SetOf(uint64_t h) {
+  return sets[h & (sets.size() - 1)];
+}
+
+template <typename K, typename Node>
+Node* HotKeyCache<K, Node>::Find(const K &key) {
+  uint64_t h = HashKey(key);
+  Set &set = SetOf(h);
+  for (unsigned int i = 0; i < kWays && set.nodes[i]; ++i) {
+    if (set.hashes[i] != h || !(set.nodes[i]->key == key))
+      continue;
+    Node *n = set.nodes[i];
+    // Move the hit one way forward, so hot keys outlive cold ones
+    if (i > 0) {
+      std::swap(set.hashes[i], set.hashes[i - 1]);
+      std::swap(set.nodes[i], set.nodes[i - 1]);
+    }
+    hits++;
+    return n;
+  }
+  misses++;
+  return nullptr;
+}
+
+template <typename K, typename Node>
+void HotKeyCache<K, Node>::Put(const K &key, Node *n) {
+  uint64_t h = HashKey(key);
+  Set &set = SetOf(h);
+  // Take the first free way or evict the last one. New keys start there and
+  // only move forward when hit again, so a burst of cold keys evicts at most
+  // one way of each set
+  unsigned int i = 0;
+  while (i < kWays - 1 && set.nodes[i])
+    ++i;
+  set.hashes[i] = h;
+  set.nodes[i] = n;
+}
+
+template <typename K, typename Node>
+void HotKeyCache<K, Node>::Erase(const K &key) {
+  uint64_t h = HashKey(key);
+  Set &set = SetOf(h);
+  // Compare hashes only, the node may already hold another key
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < kWays && set.nodes[i]; ++i) {
+    if (set.hashes[i] == h)
+      continue;
+    set.hashes[kept] = set.hashes[i];
+    set.nodes[kept++] = set.nodes[i];
+  }
+  for (; kept < kWays; ++kept)
+    set.nodes[kept] = nullptr;
+}
+
+template <typename K, typename Node>
+unsigned long long HotKeyCache<K, Node>::Hits() const {
+  return hits;
+}
+
+template <typename K, typename Node>
+unsigned long long HotKeyCache<K, Node>::Misses() const {
+  return misses;
+}
+
+#endif  // HOT_KEY_CACHE_H_
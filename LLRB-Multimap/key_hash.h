@@ -0,0 +1,37 @@
+#ifndef KEY_HASH_H_
+#define KEY_HASH_H_
+
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+// Whether std::hash is enabled for K. The trees only need < and == on their
+// keys, so the optional hashed structures stay disabled for other key types
+// instead of narrowing the keys a tree accepts.
+template <typename K, typename = void>
+struct IsHashable : std::false_type {};
+
+template <typename K>
+struct IsHashable<K, std::void_t<decltype(
+    std::hash<K>()(std::declval<const K&>()))>> : std::true_type {};
+
+// Return a well-mixed 64-bit hash of @key, 0 when K is not hashable
+template <typename K>
+uint64_t HashKey(const K &key) {
+  if constexpr (IsHashable<K>::value) {
+    // splitmix64 finalizer, std::hash is the identity for integers
+    uint64_t h = std::hash<K>()(key);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+  } else {
+    (void)key;
+    return 0;
+  }
+}
+
+#endif  // KEY_HASH_H_
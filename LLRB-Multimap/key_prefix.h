@@ -0,0 +1,46 @@
+#ifndef KEY_PREFIX_H_
+#define KEY_PREFIX_H_
+
+#include <cstdint>
+#include <string>
+
+// Inline key prefix stored in every node, so that most comparisons are
+// decided without touching out-of-line key data.
+// Generic keys carry an empty prefix and are always compared in full.
+template <typename K>
+struct KeyPrefix {
+  struct Type {};
+  // Return the prefix of @key
+  static Type Of(const K &) { return Type(); }
+  // Three-way compare two prefixes, 0 when the full keys must decide
+  static int Compare(const Type &, const Type &) { return 0; }
+  // Three-way compare two full keys
+  static int Compare(const K &a, const K &b) {
+    if (a < b) return -1;
+    return b < a;
+  }
+};
+
+// std::string keys carry their first 8 bytes packed big-endian and padded
+// with zeros, so prefixes order like the strings themselves and a
+// heap-allocated key is only read when the prefixes tie
+template <>
+struct KeyPrefix<std::string> {
+  using Type = uint64_t;
+  static Type Of(const std::string &key) {
+    Type prefix = 0;
+    for (unsigned int i = 0; i < 8; ++i) {
+      prefix <<= 8;
+      if (i < key.size())
+        prefix |= static_cast<unsigned char>(key[i]);
+    }
+    return prefix;
+  }
+  static int Compare(Type a, Type b) { return (a > b) - (a < b); }
+  static int Compare(const std::string &a, const std::string &b) {
+    int cmp = a.compare(b);
+    return (cmp > 0) - (cmp < 0);
+  }
+};
+
+#endif  // KEY_PREFIX_H_
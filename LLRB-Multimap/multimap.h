@@ -1,71 +1,381 @@
 #ifndef MULTIMAP_H_
 #define MULTIMAP_H_
 
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "bloom_filter.h"
+#include "change_log.h"
+#include "hot_key_cache.h"
+#include "key_prefix.h"
+#include "node_arena.h"
+#include "stream_io.h"
+
 template <typename K, typename V>
 class Multimap {
  public:
+  using Change = typename ChangeLog<K, V>::Change;
+
+  Multimap() = default;
+  // Copy @other in one pass, without comparisons or rotations
+  Multimap(const Multimap &other);
+  Multimap(Multimap &&other) noexcept;
+  ~Multimap();
+  Multimap& operator=(const Multimap &other);
+  Multimap& operator=(Multimap &&other) noexcept;
+  // Return a deep copy of tree
+  Multimap Clone() const;
+  // Remove every key from tree
+  void Clear();
   // Return size of tree
   unsigned int Size();
   // Return value associated to @key
   const V& Get(const K& key);
+  // Return pointer to value associated to @key, nullptr if not found
+  const V* TryGet(const K& key);
   // Return whether @key is found in tree
   bool Contains(const K& key);
+  // Return pointers to the values associated to @keys, nullptr if missing
+  std::vector<const V*> GetBatch(const std::vector<K> &keys);
+  // Return whether each of @keys is found in tree
+  std::vector<bool> ContainsBatch(const std::vector<K> &keys);
   // Return max key in tree
   const K& Max();
   // Return min key in tree
   const K& Min();
   // Insert @key in tree
   void Insert(const K &key, const V &value);
+  // Insert @key starting from the last insertion point instead of the root
+  void InsertHint(const K &key, const V &value);
+  // Route every Insert() through InsertHint(), for nearly-sorted keys
+  void SetFingerMode(bool enabled);
   // Remove @key from tree
   void Remove(const K &key);
+  // Remove every key in [@lo, @hi] from tree
+  void RemoveRange(const K &lo, const K &hi);
+  // Make Remove() leave tombstones that are purged in batches
+  void SetLazyRemove(bool enabled);
+  // Rebuild the tree without its tombstones
+  void Purge();
   // Print tree in-order
   void Print();
+  // Write every key and each of its values to @writer, one CSV line each
+  void ExportTo(BufferedWriter &writer);
+  // Insert the key and value of every CSV line of @reader, appending sorted
+  // input through the finger. K and V must be default constructible
+  void ImportFrom(BufferedReader &reader);
+  // Relocate every node into contiguous memory in depth-first order
+  void Compact();
+  // Relocate at most @budget nodes, return whether compaction is complete
+  bool CompactStep(unsigned int budget);
+  // Keep a Bloom filter sized for @expected_keys to reject missing keys,
+  // keys without std::hash are never filtered
+  void EnableFilter(unsigned int expected_keys);
+  // Drop the Bloom filter
+  void DisableFilter();
+  // Return the number of bytes held by the Bloom filter
+  size_t FilterBytes();
+  // Cache the nodes of about @entries recently looked up keys, lookups then
+  // modify the cache and must not run concurrently. Keys without std::hash
+  // are never cached
+  void EnableHotKeyCache(unsigned int entries);
+  // Drop the hot-key cache
+  void DisableHotKeyCache();
+  // Return the number of lookups answered by the hot-key cache
+  unsigned long long CacheHits();
+  // Return the number of lookups that missed the hot-key cache
+  unsigned long long CacheMisses();
+  // Return the version of tree, bumped by every insertion and removal
+  unsigned long long Version();
+  // Record the @capacity most recent changes for ChangesSince()
+  void EnableChangeLog(unsigned int capacity);
+  // Stop recording changes
+  void DisableChangeLog();
+  // Append the changes made after @version to @changes, return false when
+  // they are no longer all recorded and a full resync is needed
+  bool ChangesSince(unsigned long long version, std::vector<Change> *changes);
+  // Call @visit on every key and each of its values in order
+  template <typename F>
+  void ForEach(F visit);
 
  private:
   enum Color { RED, BLACK };
+  using Prefix = typename KeyPrefix<K>::Type;
   // we use std::vector to store values
   // std::vector allows us to adjust the size of the container despite slower
   // std::array will have fixed size, which results in waste space
   // even though it is faster to access element
+  struct Node;
+  // Frees heap nodes but only destroys nodes living in an arena
+  struct NodeDeleter {
+    void operator()(Node *n) const;
+  };
+  using NodePtr = std::unique_ptr<Node, NodeDeleter>;
   struct Node{
     K key;
     std::vector<V> value;
     bool color;
-    std::unique_ptr<Node> left;
-    std::unique_ptr<Node> right;
+    // Whether the node lives in an arena rather than its own heap block
+    bool pooled;
+    // Inline prefix of @key, compared before the key itself
+    Prefix prefix;
+    NodePtr left;
+    NodePtr right;
+  };
+  // Finger on the last insertion point: the owning pointers on the path from
+  // the root, each with the exclusive key bounds of its subtree
+  struct FingerLevel {
+    NodePtr *slot;
+    const K *lo;
+    const K *hi;
+  };
+  // State of the optional features, allocated once one of them is used so
+  // that a plain tree holds nothing but its root and counters
+  struct Extras {
+    // Arenas holding compacted nodes
+    std::vector<std::unique_ptr<NodeArena<Node>>> arenas;
+    // Bloom filter over the keys, rebuilt as removals leave stale bits
+    BloomFilter<K> filter;
+    unsigned int filter_capacity = 0;
+    unsigned int filter_removes = 0;
+    // Nodes of recently looked up keys
+    HotKeyCache<K, Node> cache;
+    std::vector<FingerLevel> finger;
+    bool finger_mode = false;
+    // Lazy removal leaves @dead_nodes tombstones in the tree
+    bool lazy_remove = false;
+    unsigned int dead_nodes = 0;
+    // Compaction pass in progress: its arenas start at @compact_arena and
+    // @compact_stack holds the owning pointers still to visit depth-first.
+    // @pooled_nodes counts nodes living in any arena and @stale_nodes those
+    // still left in the arenas of earlier passes
+    bool compacting = false;
+    bool compact_sweep = false;
+    unsigned int compact_arena = 0;
+    std::vector<NodePtr*> compact_stack;
+    unsigned int pooled_nodes = 0;
+    unsigned int stale_nodes = 0;
+    // The most recent changes
+    ChangeLog<K, V> change_log;
   };
-  std::unique_ptr<Node> root;
+  // Declared before @root so that the nodes are destroyed before the arenas
+  // holding them
+  std::unique_ptr<Extras> extras;
+  NodePtr root;
   unsigned int cur_size = 0;
+  // Nodes in tree, tombstones included, which sizes the arenas
+  unsigned int node_count = 0;
+  // Bumped by every change
+  unsigned long long version = 0;
+
+  // Number of lookups advanced in lockstep by the batched methods
+  static constexpr unsigned int kBatchWidth = 16;
 
   // Iterative helper methods
   Node* Get(Node *n, const K &key);
+  static int Compare(const K &key, const Prefix &prefix, const Node *n);
+  Node* Lookup(const K &key);
+  void GetBatch(const K *keys, Node **found, unsigned int count);
+  static void Prefetch(const Node *n);
 
   // Recursive helper methods
   Node* Min(Node *n);
-  void Insert(std::unique_ptr<Node> &n, const K &key, const V &value);
-  void Remove(std::unique_ptr<Node> &n, const K &key);
+  Node* MinLive(Node *n);
+  Node* MaxLive(Node *n);
+  void RemoveRange(Node *n, const K &lo, const K &hi, std::vector<K> &keys);
+  void Detach(NodePtr &n, std::vector<NodePtr> &nodes);
+  void Insert(NodePtr &n, const K &key, const V &value);
+  void Remove(NodePtr &n, const K &key);
   void Print(Node *n);
+  void RebuildFilter(Node *n);
+  template <typename F>
+  void ForEach(Node *n, F &visit);
+
+  // Helper methods for the Bloom filter
+  void AddToFilter(const K &key);
+  void RebuildFilter();
+  unsigned int KeyCount();
+
+  // Helper method for the hot-key cache
+  void Uncache(const K &key);
+
+  // Helper method for the change log
+  void Record(ChangeOp op, const K &key, const V &value);
+
+  // Helper methods for the finger
+  NodePtr& FingerSlot(const K &key);
+  void FixUpFinger();
+
+  // Helper methods for the removal
+  static bool Dead(const Node *n);
+  void Erase(const K &key);
+
+  // Helper method for the optional state
+  Extras& Extra();
+
+  // Helper methods for the node storage
+  NodePtr NewNode(const K &key, const V &value);
+  void DestroyNodes();
+  void FreeNode(NodePtr &n);
+  bool Compacted(const Node *n);
+  void Relocate(NodePtr &n);
 
   // Helper methods for the self-balancing
   bool IsRed(Node *n);
   void FlipColors(Node *n);
-  void RotateRight(std::unique_ptr<Node> &prt);
-  void RotateLeft(std::unique_ptr<Node> &prt);
-  void FixUp(std::unique_ptr<Node> &n);
-  void MoveRedRight(std::unique_ptr<Node> &n);
-  void MoveRedLeft(std::unique_ptr<Node> &n);
-  void DeleteMin(std::unique_ptr<Node> &n);
+  void RotateRight(NodePtr &prt);
+  void RotateLeft(NodePtr &prt);
+  void FixUp(NodePtr &n);
+  void MoveRedRight(NodePtr &n);
+  void MoveRedLeft(NodePtr &n);
+  void DeleteMin(NodePtr &n);
 
   // Iterative helper printing function for debugging
   void PrintVector(const std::vector<V> &value_vector) noexcept;
 };
 
+template <typename K, typename V>
+Multimap<K, V>::Multimap(const Multimap &other) {
+  cur_size = other.cur_size;
+  node_count = other.node_count;
+  version = other.version;
+  if (other.extras) {
+    Extras &x = Extra();
+    x.dead_nodes = other.extras->dead_nodes;
+    x.lazy_remove = other.extras->lazy_remove;
+    x.finger_mode = other.extras->finger_mode;
+    x.filter = other.extras->filter;
+    x.filter_capacity = other.extras->filter_capacity;
+    x.filter_removes = other.extras->filter_removes;
+    x.change_log = other.extras->change_log;
+    // Same cache size, but pointing at none of the copied nodes
+    x.cache = other.extras->cache;
+    x.cache.Invalidate();
+  }
+  if (!other.root)
+    return;
+
+  // Reproduce the shape and colors of @other in preorder. Nodes get their
+  // own blocks, like inserted ones, so that removals free them right away
+  std::vector<std::pair<const Node*, NodePtr*>> stack;
+  stack.emplace_back(other.root.get(), &root);
+  while (!stack.empty()) {
+    const Node *src = stack.back().first;
+    NodePtr &dst = *stack.back().second;
+    stack.pop_back();
+    dst.reset(new Node{src->key, src->value, src->color, false,
+                       src->prefix, nullptr, nullptr});
+    if (src->right)
+      stack.emplace_back(src->right.get(), &dst->right);
+    if (src->left)
+      stack.emplace_back(src->left.get(), &dst->left);
+  }
+}
+
+template <typename K, typename V>
+Multimap<K, V>::Multimap(Multimap &&other) noexcept {
+  *this = std::move(other);
+}
+
+template <typename K, typename V>
+Multimap<K, V>::~Multimap() {
+  DestroyNodes();
+}
+
+template <typename K, typename V>
+Multimap<K, V>& Multimap<K, V>::operator=(const Multimap &other) {
+  if (this != &other)
+    *this = Multimap(other);
+  return *this;
+}
+
+template <typename K, typename V>
+Multimap<K, V>& Multimap<K, V>::operator=(Multimap &&other) noexcept {
+  if (this == &other)
+    return *this;
+  // Trade our emptied tree for @other's nodes, which stay where they are
+  DestroyNodes();
+  extras.swap(other.extras);
+  root.swap(other.root);
+  std::swap(cur_size, other.cur_size);
+  std::swap(node_count, other.node_count);
+  // Both trees changed wholesale: move their versions past any version a
+  // consumer has seen and drop their logs, so that consumers resync
+  version = std::max(version, other.version) + 1;
+  other.version++;
+  if (other.extras)
+    other.extras->change_log.Truncate(other.version);
+  if (extras) {
+    extras->change_log.Truncate(version);
+    // The finger and a compaction pass in progress point at @other.root
+    extras->finger.clear();
+    extras->compacting = false;
+    extras->compact_stack.clear();
+  }
+  return *this;
+}
+
+template <typename K, typename V>
+Multimap<K, V> Multimap<K, V>::Clone() const {
+  return Multimap(*this);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Clear() {
+  DestroyNodes();
+  version++;
+  if (!extras)
+    return;
+  extras->change_log.Truncate(version);
+  if (extras->filter.Enabled())
+    RebuildFilter();
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::DestroyNodes() {
+  // Tear down iteratively, the destructor of a NodePtr would recurse once
+  // per level
+  std::vector<NodePtr> stack;
+  if (root)
+    stack.push_back(std::move(root));
+  while (!stack.empty()) {
+    NodePtr n = std::move(stack.back());
+    stack.pop_back();
+    if (n->left)
+      stack.push_back(std::move(n->left));
+    if (n->right)
+      stack.push_back(std::move(n->right));
+  }
+  cur_size = 0;
+  node_count = 0;
+  if (!extras)
+    return;
+  extras->arenas.clear();
+  extras->dead_nodes = 0;
+  extras->pooled_nodes = 0;
+  extras->finger.clear();
+  extras->compacting = false;
+  extras->compact_stack.clear();
+  extras->cache.Invalidate();
+}
+
+template <typename K, typename V>
+typename Multimap<K, V>::Extras& Multimap<K, V>::Extra() {
+  if (!extras) {
+    extras.reset(new Extras());
+    // Changes made so far were never recorded
+    extras->change_log.Truncate(version);
+  }
+  return *extras;
+}
+
 template <typename K, typename V>
 unsigned int Multimap<K, V>::Size() {
   return cur_size;
@@ -73,11 +383,13 @@ unsigned int Multimap<K, V>::Size() {
 
 template <typename K, typename V>
 typename Multimap<K, V>::Node* Multimap<K, V>::Get(Node *n, const K &key) {
+  Prefix prefix = KeyPrefix<K>::Of(key);
   while (n) {
-    if (key == n->key)
+    int cmp = Compare(key, prefix, n);
+    if (cmp == 0)
       return n;
 
-    if (key < n->key)
+    if (cmp < 0)
       n = n->left.get();
     else
       n = n->right.get();
@@ -86,27 +398,135 @@ typename Multimap<K, V>::Node* Multimap<K, V>::Get(Node *n, const K &key) {
 }
 
 template <typename K, typename V>
-const V& Multimap<K, V>::Get(const K &key) {
+int Multimap<K, V>::Compare(const K &key, const Prefix &prefix, const Node *n) {
+  // Only read the full key when the inline prefixes tie
+  int cmp = KeyPrefix<K>::Compare(prefix, n->prefix);
+  if (cmp != 0)
+    return cmp;
+  return KeyPrefix<K>::Compare(key, n->key);
+}
+
+template <typename K, typename V>
+typename Multimap<K, V>::Node* Multimap<K, V>::Lookup(const K &key) {
+  Extras *x = extras.get();
+  if (x && x->cache.Enabled()) {
+    // Removed keys are uncached, a cached node is always live
+    if (Node *n = x->cache.Find(key))
+      return n;
+  }
+  if (x && !x->filter.MayContain(key))
+    return nullptr;
   Node *n = Get(root.get(), key);
-  if (!n)
+  if (n && Dead(n))
+    return nullptr;
+  if (n && x && x->cache.Enabled())
+    x->cache.Put(key, n);
+  return n;
+}
+
+template <typename K, typename V>
+const V& Multimap<K, V>::Get(const K &key) {
+  const V *value = TryGet(key);
+  if (!value)
     throw std::runtime_error("Error: cannot find key");
-  return n->value[0];
+  return *value;
+}
+
+template <typename K, typename V>
+const V* Multimap<K, V>::TryGet(const K &key) {
+  Node *n = Lookup(key);
+  if (!n)
+    return nullptr;
+  return &n->value[0];
 }
 
 template <typename K, typename V>
 bool Multimap<K, V>::Contains(const K &key) {
-  return Get(root.get(), key) != nullptr;
+  return Lookup(key) != nullptr;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Prefetch(const Node *n) {
+#if defined(__GNUC__)
+  if (n) __builtin_prefetch(n);
+#else
+  (void)n;
+#endif
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::GetBatch(const K *keys, Node **found, unsigned int count) {
+  Node *cur[kBatchWidth];
+  Prefix prefixes[kBatchWidth];
+  for (unsigned int base = 0; base < count; base += kBatchWidth) {
+    unsigned int width =
+        count - base < kBatchWidth ? count - base : kBatchWidth;
+    // Keys rejected by the filter do not descend at all
+    bool active = false;
+    for (unsigned int i = 0; i < width; ++i) {
+      bool may_contain = !extras || extras->filter.MayContain(keys[base + i]);
+      cur[i] = may_contain ? root.get() : nullptr;
+      prefixes[i] = KeyPrefix<K>::Of(keys[base + i]);
+      found[base + i] = nullptr;
+      active |= cur[i] != nullptr;
+    }
+    // Descend all lookups of the group one level per round, prefetching the
+    // next node of each so that their cache misses overlap
+    while (active) {
+      active = false;
+      for (unsigned int i = 0; i < width; ++i) {
+        Node *n = cur[i];
+        if (!n) continue;
+        int cmp = Compare(keys[base + i], prefixes[i], n);
+        if (cmp == 0) {
+          found[base + i] = Dead(n) ? nullptr : n;
+          cur[i] = nullptr;
+          continue;
+        }
+        n = cmp < 0 ? n->left.get() : n->right.get();
+        Prefetch(n);
+        cur[i] = n;
+        active |= n != nullptr;
+      }
+    }
+  }
+}
+
+template <typename K, typename V>
+std::vector<const V*> Multimap<K, V>::GetBatch(const std::vector<K> &keys) {
+  std::vector<Node*> found(keys.size());
+  GetBatch(keys.data(), found.data(), keys.size());
+  std::vector<const V*> values(keys.size());
+  for (unsigned int i = 0; i < keys.size(); ++i) {
+    Node *n = found[i];
+    values[i] = n ? &n->value[0] : nullptr;
+  }
+  return values;
+}
+
+template <typename K, typename V>
+std::vector<bool> Multimap<K, V>::ContainsBatch(const std::vector<K> &keys) {
+  std::vector<Node*> found(keys.size());
+  GetBatch(keys.data(), found.data(), keys.size());
+  std::vector<bool> contained(keys.size());
+  for (unsigned int i = 0; i < keys.size(); ++i)
+    contained[i] = found[i] != nullptr;
+  return contained;
 }
 
 template <typename K, typename V>
 const K& Multimap<K, V>::Max(void) {
   Node *n = root.get();
+  if (extras && extras->dead_nodes)
+    return MaxLive(n)->key;
   while (n->right) n = n->right.get();
   return n->key;
 }
 
 template <typename K, typename V>
 const K& Multimap<K, V>::Min(void) {
+  if (extras && extras->dead_nodes)
+    return MinLive(root.get())->key;
   return Min(root.get())->key;
 }
 
@@ -118,6 +538,26 @@ typename Multimap<K, V>::Node* Multimap<K, V>::Min(Node *n) {
     return n;
 }
 
+template <typename K, typename V>
+typename Multimap<K, V>::Node* Multimap<K, V>::MinLive(Node *n) {
+  if (!n) return nullptr;
+  if (Node *live = MinLive(n->left.get()))
+    return live;
+  if (!Dead(n))
+    return n;
+  return MinLive(n->right.get());
+}
+
+template <typename K, typename V>
+typename Multimap<K, V>::Node* Multimap<K, V>::MaxLive(Node *n) {
+  if (!n) return nullptr;
+  if (Node *live = MaxLive(n->right.get()))
+    return live;
+  if (!Dead(n))
+    return n;
+  return MaxLive(n->left.get());
+}
+
 template <typename K, typename V>
 bool Multimap<K, V>::IsRed(Node *n) {
   if (!n) return false;
@@ -132,8 +572,8 @@ void Multimap<K, V>::FlipColors(Node *n) {
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::RotateRight(std::unique_ptr<Node> &prt) {
-  std::unique_ptr<Node> chd = std::move(prt->left);
+void Multimap<K, V>::RotateRight(NodePtr &prt) {
+  NodePtr chd = std::move(prt->left);
   prt->left = std::move(chd->right);
   chd->color = prt->color;
   prt->color = RED;
@@ -142,8 +582,8 @@ void Multimap<K, V>::RotateRight(std::unique_ptr<Node> &prt) {
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::RotateLeft(std::unique_ptr<Node> &prt) {
-  std::unique_ptr<Node> chd = std::move(prt->right);
+void Multimap<K, V>::RotateLeft(NodePtr &prt) {
+  NodePtr chd = std::move(prt->right);
   prt->right = std::move(chd->left);
   chd->color = prt->color;
   prt->color = RED;
@@ -152,7 +592,7 @@ void Multimap<K, V>::RotateLeft(std::unique_ptr<Node> &prt) {
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::FixUp(std::unique_ptr<Node> &n) {
+void Multimap<K, V>::FixUp(NodePtr &n) {
   // Rotate left if there is a right-leaning red node
   if (IsRed(n->right.get()) && !IsRed(n->left.get()))
     RotateLeft(n);
@@ -165,7 +605,7 @@ void Multimap<K, V>::FixUp(std::unique_ptr<Node> &n) {
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::MoveRedRight(std::unique_ptr<Node> &n) {
+void Multimap<K, V>::MoveRedRight(NodePtr &n) {
   FlipColors(n.get());
   if (IsRed(n->left->left.get())) {
     RotateRight(n);
@@ -174,7 +614,7 @@ void Multimap<K, V>::MoveRedRight(std::unique_ptr<Node> &n) {
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::MoveRedLeft(std::unique_ptr<Node> &n) {
+void Multimap<K, V>::MoveRedLeft(NodePtr &n) {
   FlipColors(n.get());
   if (IsRed(n->right->left.get())) {
     RotateRight(n->right);
@@ -184,11 +624,11 @@ void Multimap<K, V>::MoveRedLeft(std::unique_ptr<Node> &n) {
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::DeleteMin(std::unique_ptr<Node> &n) {
+void Multimap<K, V>::DeleteMin(NodePtr &n) {
   // No left child, min is 'n'
   if (!n->left) {
     // Remove n
-    n = nullptr;
+    FreeNode(n);
     return;
   }
 
@@ -202,16 +642,38 @@ void Multimap<K, V>::DeleteMin(std::unique_ptr<Node> &n) {
 
 template <typename K, typename V>
 void Multimap<K, V>::Remove(const K &key) {
-  if (!Contains(key))
+  Node *n = Lookup(key);
+  if (!n)
     return;
-  Remove(root, key);
   cur_size--;
+  Uncache(key);
+  Record(ChangeOp::kRemove, key, n->value.front());
+  if (extras && extras->lazy_remove) {
+    // Drop the first value, the node is a tombstone once none is left
+    n->value.erase(n->value.begin());
+    if (n->value.empty() && ++extras->dead_nodes > cur_size)
+      Purge();
+    return;
+  }
+  Erase(key);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Erase(const K &key) {
+  Remove(root, key);
   if (root)
     root->color = BLACK;
+  if (!extras)
+    return;
+  // Deletion restructures top-down, so the finger cannot be repaired
+  extras->finger.clear();
+  if (extras->filter.Enabled() &&
+      extras->filter_removes > extras->filter_capacity / 2)
+    RebuildFilter();
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::Remove(std::unique_ptr<Node> &n, const K &key) {
+void Multimap<K, V>::Remove(NodePtr &n, const K &key) {
   // Key not found
   if (!n) return;
 
@@ -229,7 +691,7 @@ void Multimap<K, V>::Remove(std::unique_ptr<Node> &n, const K &key) {
       if (n->value.size() > 1)
         n->value.erase(n->value.begin());
       else
-        n = nullptr;
+        FreeNode(n);
       return;
     }
 
@@ -247,6 +709,7 @@ void Multimap<K, V>::Remove(std::unique_ptr<Node> &n, const K &key) {
         // Copy content from min node
         n->key = n_min->key;
         n->value = std::move(n_min->value);
+        n->prefix = n_min->prefix;
         // Delete min node recursively
         DeleteMin(n->right);
       }
@@ -260,22 +723,32 @@ void Multimap<K, V>::Remove(std::unique_ptr<Node> &n, const K &key) {
 
 template <typename K, typename V>
 void Multimap<K, V>::Insert(const K &key, const V &value) {
+  if (extras) {
+    if (extras->finger_mode) {
+      InsertHint(key, value);
+      return;
+    }
+    extras->finger.clear();
+  }
   Insert(root, key, value);
   cur_size++;
   root->color = BLACK;
+  AddToFilter(key);
+  Record(ChangeOp::kInsert, key, value);
 }
 
 template <typename K, typename V>
-void Multimap<K, V>::Insert(std::unique_ptr<Node> &n,
+void Multimap<K, V>::Insert(NodePtr &n,
                        const K &key, const V &value) {
   if (!n) {
-    std::vector<V> vec(1, value);
-    n = std::unique_ptr<Node> (new Node{key, vec, RED, nullptr, nullptr});
+    n = NewNode(key, value);
   } else if (key < n->key) {
     Insert(n->left, key, value);
   } else if (key > n->key) {
     Insert(n->right, key, value);
   } else {
+    if (n->value.empty())
+      extras->dead_nodes--;
     n->value.emplace_back(value);
   }
   FixUp(n);
@@ -284,27 +757,491 @@ void Multimap<K, V>::Insert(std::unique_ptr<Node> &n,
 template <typename K, typename V>
 void Multimap<K, V>::Print() {
   Print(root.get());
+  std::cout << std::flush;
 }
 
 template <typename K, typename V>
 void Multimap<K, V>::Print(Node *n) {
   if (!n) return;
   Print(n->left.get());
-  std::cout << "<" << n->key << ",";
-  PrintVector(n->value);
-  std::cout << "> " << std::endl;
+  if (!Dead(n)) {
+    std::cout << "<" << n->key << ",";
+    PrintVector(n->value);
+    std::cout << "> \n";
+  }
   Print(n->right.get());
 }
 
 template<typename K, typename V>
 void Multimap<K, V>::PrintVector(const std::vector<V> &value_vector) noexcept {
-  for (const auto &values : value_vector) {
+  for (unsigned int i = 0; i < value_vector.size(); ++i) {
     // make the printing look nicer
-    if (values == value_vector.back())
-      std::cout << values;
+    if (i > 0)
+      std::cout << " ";
+    std::cout << value_vector[i];
+  }
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::ExportTo(BufferedWriter &writer) {
+  ForEach([&writer](const K &key, const V &value) {
+    CsvField<K>::Write(writer, key);
+    writer.Put(',');
+    CsvField<V>::Write(writer, value);
+    writer.Put('\n');
+  });
+  writer.Flush();
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::ImportFrom(BufferedReader &reader) {
+  std::string_view line, key_field, value_field;
+  K key;
+  V value;
+  for (unsigned int number = 1; reader.ReadLine(&line); ++number) {
+    if (!SplitRecord(line, &key_field, &value_field) ||
+        !CsvField<K>::Parse(key_field, &key) ||
+        !CsvField<V>::Parse(value_field, &value))
+      throw std::runtime_error("Error: malformed line " +
+                               std::to_string(number));
+    // The finger turns sorted input into appends and still handles any
+    // other order
+    InsertHint(key, value);
+  }
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::EnableFilter(unsigned int expected_keys) {
+  // Size for keys, a key holding many values sets the same bits
+  unsigned int keys = KeyCount();
+  Extra().filter_capacity = expected_keys > keys ? expected_keys : keys;
+  RebuildFilter();
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::DisableFilter() {
+  if (!extras)
+    return;
+  extras->filter.Clear();
+  extras->filter_capacity = 0;
+  extras->filter_removes = 0;
+}
+
+template <typename K, typename V>
+size_t Multimap<K, V>::FilterBytes() {
+  return extras ? extras->filter.Bytes() : 0;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::AddToFilter(const K &key) {
+  if (!extras || !extras->filter.Enabled())
+    return;
+  unsigned int keys = KeyCount();
+  if (keys > extras->filter_capacity) {
+    // Grow the filter before its false positive rate degrades
+    extras->filter_capacity = 2 * keys;
+    RebuildFilter();
+  } else {
+    extras->filter.Add(key);
+  }
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::RebuildFilter() {
+  extras->filter.Reset(extras->filter_capacity);
+  extras->filter_removes = 0;
+  RebuildFilter(root.get());
+}
+
+template <typename K, typename V>
+unsigned int Multimap<K, V>::KeyCount() {
+  return node_count - (extras ? extras->dead_nodes : 0);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::RebuildFilter(Node *n) {
+  if (!n) return;
+  if (!Dead(n))
+    extras->filter.Add(n->key);
+  RebuildFilter(n->left.get());
+  RebuildFilter(n->right.get());
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::SetFingerMode(bool enabled) {
+  Extra().finger_mode = enabled;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::InsertHint(const K &key, const V &value) {
+  NodePtr &slot = FingerSlot(key);
+  if (slot) {
+    if (slot->value.empty())
+      extras->dead_nodes--;
+    slot->value.emplace_back(value);
+    cur_size++;
+    AddToFilter(key);
+    Record(ChangeOp::kInsert, key, value);
+    return;
+  }
+  slot = NewNode(key, value);
+  cur_size++;
+  FixUpFinger();
+  root->color = BLACK;
+  AddToFilter(key);
+  Record(ChangeOp::kInsert, key, value);
+}
+
+template <typename K, typename V>
+typename Multimap<K, V>::NodePtr& Multimap<K, V>::FingerSlot(const K &key) {
+  std::vector<FingerLevel> &finger = Extra().finger;
+  if (finger.empty())
+    finger.push_back(FingerLevel{&root, nullptr, nullptr});
+  // Climb to the deepest subtree on the finger whose key range holds @key
+  while (finger.size() > 1) {
+    const FingerLevel &level = finger.back();
+    if ((!level.lo || *level.lo < key) && (!level.hi || key < *level.hi))
+      break;
+    finger.pop_back();
+  }
+  // Descend from there as Insert() would, extending the finger up to the
+  // node holding @key or the empty slot where it belongs
+  while (Node *n = finger.back().slot->get()) {
+    FingerLevel level = finger.back();
+    if (key < n->key)
+      finger.push_back(FingerLevel{&n->left, level.lo, &n->key});
+    else if (key > n->key)
+      finger.push_back(FingerLevel{&n->right, &n->key, level.hi});
     else
-      std::cout << values << " ";
+      break;
+  }
+  return *finger.back().slot;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::FixUpFinger() {
+  std::vector<FingerLevel> &finger = extras->finger;
+  // Call FixUp() bottom-up along the finger like the recursive Insert(), but
+  // stop at the first subtree that looks unchanged to its parent: the parent
+  // only inspects the subtree's root color and, for a left child, the color
+  // of its left child, so every FixUp() above would be a no-op
+  bool child_was_red = false;
+  for (unsigned int i = finger.size() - 1; ; --i) {
+    NodePtr &n = *finger[i].slot;
+    bool bottom = i + 1 == finger.size();
+    bool was_red = !bottom && IsRed(n.get());
+    bool left_was_red = IsRed(n->left.get());
+    if (!bottom && finger[i + 1].slot == &n->left)
+      left_was_red = child_was_red;
+
+    FixUp(n);
+
+    bool is_left = i > 0 && finger[i].slot == &(*finger[i - 1].slot)->left;
+    if (i == 0 || (IsRed(n.get()) == was_red &&
+                   (!is_left || IsRed(n->left.get()) == left_was_red))) {
+      // Rotations may have reshaped everything below, keep the stable prefix
+      finger.resize(i + 1);
+      return;
+    }
+    child_was_red = was_red;
+  }
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::NodeDeleter::operator()(Node *n) const {
+  if (n->pooled)
+    n->~Node();
+  else
+    delete n;
+}
+
+template <typename K, typename V>
+typename Multimap<K, V>::NodePtr Multimap<K, V>::NewNode(const K &key,
+                                                   const V &value) {
+  node_count++;
+  std::vector<V> vec(1, value);
+  return NodePtr(new Node{key, vec, RED, false, KeyPrefix<K>::Of(key),
+                          nullptr, nullptr});
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::FreeNode(NodePtr &n) {
+  // Deleted nodes are leaves: only their own child pointers can be on the
+  // compaction stack
+  if (extras && extras->compacting) {
+    std::vector<NodePtr*> &stack = extras->compact_stack;
+    for (unsigned int i = 0; i < stack.size(); ++i) {
+      if (stack[i] == &n->left || stack[i] == &n->right)
+        stack.erase(stack.begin() + i--);
+    }
+  }
+  // Only trees with @extras keep nodes in arenas
+  if (n->pooled) {
+    extras->pooled_nodes--;
+    if (extras->compacting && !Compacted(n.get()))
+      extras->stale_nodes--;
+  }
+  Uncache(n->key);
+  // The key of a freed node leaves stale bits in the filter
+  if (extras && extras->filter.Enabled())
+    extras->filter_removes++;
+  node_count--;
+  n = nullptr;
+}
+
+template <typename K, typename V>
+bool Multimap<K, V>::Compacted(const Node *n) {
+  Extras &x = *extras;
+  for (unsigned int i = x.compact_arena; i < x.arenas.size(); ++i) {
+    if (x.arenas[i]->Owns(n))
+      return true;
+  }
+  return false;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Compact() {
+  // Start over so that the whole tree ends up in a single arena
+  Extra().compacting = false;
+  CompactStep(~0u);
+}
+
+template <typename K, typename V>
+bool Multimap<K, V>::CompactStep(unsigned int budget) {
+  Extras &x = Extra();
+  if (!x.compacting) {
+    // Size the arena for every node, tombstones included
+    x.compacting = true;
+    x.compact_sweep = false;
+    x.compact_arena = x.arenas.size();
+    x.arenas.emplace_back(new NodeArena<Node>(node_count));
+    x.compact_stack.assign(1, &root);
+    x.stale_nodes = x.pooled_nodes;
+  }
+
+  // Visit in preorder, so every subtree ends up contiguous with its left
+  // child right after its root. The stack only holds child pointers of
+  // relocated nodes: rotations keep them valid and FreeNode() scrubs them
+  for (; budget && !x.compact_stack.empty(); --budget) {
+    NodePtr &n = *x.compact_stack.back();
+    x.compact_stack.pop_back();
+    if (!n)
+      continue;
+    if (Compacted(n.get())) {
+      // Only a sweep looks below nodes that were relocated already
+      if (!x.compact_sweep)
+        continue;
+    } else {
+      Relocate(n);
+    }
+    if (n->right)
+      x.compact_stack.push_back(&n->right);
+    if (n->left)
+      x.compact_stack.push_back(&n->left);
+  }
+  if (!x.compact_stack.empty())
+    return false;
+
+  if (x.stale_nodes > 0) {
+    // Rotations moved nodes of older arenas below visited nodes, sweep the
+    // whole tree for them before those arenas can be released
+    x.compact_sweep = true;
+    x.compact_stack.assign(1, &root);
+    return false;
+  }
+  x.arenas.erase(x.arenas.begin(), x.arenas.begin() + x.compact_arena);
+  x.compacting = false;
+  return true;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Relocate(NodePtr &n) {
+  Extras &x = *extras;
+  void *storage = x.arenas.back()->Allocate();
+  if (!storage) {
+    // Nodes were inserted during the pass, continue in another arena
+    x.arenas.emplace_back(new NodeArena<Node>(node_count / 2 + 1));
+    storage = x.arenas.back()->Allocate();
   }
+  // The finger points into the nodes being moved
+  x.finger.clear();
+  Node *old = n.get();
+  Uncache(old->key);
+  if (old->pooled)
+    x.stale_nodes--;
+  else
+    x.pooled_nodes++;
+  Node *moved = new (storage) Node{
+      std::move(old->key),
+      // Reallocate the values too, so they follow the node order
+      std::vector<V>(std::make_move_iterator(old->value.begin()),
+                     std::make_move_iterator(old->value.end())),
+      old->color, true, old->prefix,
+      std::move(old->left), std::move(old->right)};
+  // @old no longer owns any child, so this frees only @old itself
+  n.reset(moved);
+}
+
+template <typename K, typename V>
+bool Multimap<K, V>::Dead(const Node *n) {
+  return n->value.empty();
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::SetLazyRemove(bool enabled) {
+  Extras &x = Extra();
+  x.lazy_remove = enabled;
+  if (!x.lazy_remove && x.dead_nodes)
+    Purge();
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::RemoveRange(const K &lo, const K &hi) {
+  Extras &x = Extra();
+  // Mark the range first, tombstones are then either kept, erased one by one
+  // or dropped by a rebuild, whichever is cheaper
+  std::vector<K> keys;
+  RemoveRange(root.get(), lo, hi, keys);
+  if (x.dead_nodes > cur_size) {
+    Purge();
+  } else if (!x.lazy_remove) {
+    for (const auto &key : keys) {
+      Erase(key);
+      x.dead_nodes--;
+    }
+  }
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::RemoveRange(Node *n, const K &lo, const K &hi,
+                              std::vector<K> &keys) {
+  if (!n) return;
+  if (lo < n->key)
+    RemoveRange(n->left.get(), lo, hi, keys);
+  if (!Dead(n) && !(n->key < lo) && !(hi < n->key)) {
+    cur_size -= n->value.size();
+    Uncache(n->key);
+    for (const auto &value : n->value)
+      Record(ChangeOp::kRemove, n->key, value);
+    n->value.clear();
+    extras->dead_nodes++;
+    keys.push_back(n->key);
+  }
+  if (n->key < hi)
+    RemoveRange(n->right.get(), lo, hi, keys);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Purge() {
+  Extras &x = Extra();
+  // Unlink the live nodes in order, then relink them as sorted appends
+  // through the finger, which costs amortized O(1) each
+  std::vector<NodePtr> nodes;
+  nodes.reserve(node_count - x.dead_nodes);
+  Detach(root, nodes);
+  x.dead_nodes = 0;
+  x.finger.clear();
+  for (auto &n : nodes) {
+    n->color = RED;
+    NodePtr &slot = FingerSlot(n->key);
+    slot = std::move(n);
+    FixUpFinger();
+    root->color = BLACK;
+  }
+  // The tree was rebuilt under the compaction pass, sweep it again
+  if (x.compacting) {
+    x.compact_sweep = true;
+    x.compact_stack.assign(1, &root);
+  }
+  if (x.filter.Enabled())
+    RebuildFilter();
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Detach(NodePtr &n, std::vector<NodePtr> &nodes) {
+  if (!n) return;
+  Detach(n->left, nodes);
+  NodePtr right = std::move(n->right);
+  if (Dead(n.get()))
+    FreeNode(n);
+  else
+    nodes.push_back(std::move(n));
+  Detach(right, nodes);
+}
+
+template <typename K, typename V>
+unsigned long long Multimap<K, V>::Version() {
+  return version;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::EnableChangeLog(unsigned int capacity) {
+  Extra().change_log.Reset(capacity, version);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::DisableChangeLog() {
+  if (extras)
+    extras->change_log.Reset(0, version);
+}
+
+template <typename K, typename V>
+bool Multimap<K, V>::ChangesSince(unsigned long long version,
+                               std::vector<Change> *changes) {
+  // Without a change log only the current version is up to date
+  if (!extras)
+    return version == this->version;
+  return extras->change_log.Since(version, changes);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Record(ChangeOp op, const K &key, const V &value) {
+  version++;
+  if (extras)
+    extras->change_log.Record(version, op, key, value);
+}
+
+template <typename K, typename V>
+template <typename F>
+void Multimap<K, V>::ForEach(F visit) {
+  ForEach(root.get(), visit);
+}
+
+template <typename K, typename V>
+template <typename F>
+void Multimap<K, V>::ForEach(Node *n, F &visit) {
+  if (!n) return;
+  ForEach(n->left.get(), visit);
+  for (const auto &value : n->value)
+    visit(n->key, value);
+  ForEach(n->right.get(), visit);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::EnableHotKeyCache(unsigned int entries) {
+  Extra().cache.Reset(entries);
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::DisableHotKeyCache() {
+  if (extras)
+    extras->cache.Clear();
+}
+
+template <typename K, typename V>
+unsigned long long Multimap<K, V>::CacheHits() {
+  return extras ? extras->cache.Hits() : 0;
+}
+
+template <typename K, typename V>
+unsigned long long Multimap<K, V>::CacheMisses() {
+  return extras ? extras->cache.Misses() : 0;
+}
+
+template <typename K, typename V>
+void Multimap<K, V>::Uncache(const K &key) {
+  if (extras && extras->cache.Enabled())
+    extras->cache.Erase(key);
 }
 
 #endif  // MULTIMAP_H_
@@ -1,6 +1,14 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
+#include "combining_multimap.h"
 #include "multimap.h"
+#include "small_map.h"
 // Error testing with Get()
 TEST(Multimap, GetErrorChecking) {
   Multimap<int, int> Multimap;
@@ -312,6 +320,541 @@ TEST(Multimap, ComplexInsertRemoveKeys) {
   }
 }
 
+// Batched lookups should agree with Get() and Contains()
+TEST(Multimap, GetBatch) {
+  Multimap<int, int> Multimap;
+  for (int i = 0; i < 100; i += 2) {
+    Multimap.Insert(i, i);
+    Multimap.Insert(i, i + 1);
+  }
+  std::vector<int> keys;
+  for (int i = -5; i < 105; ++i)
+    keys.push_back(i);
+  std::random_shuffle(keys.begin(), keys.end());
+
+  std::vector<const int*> values = Multimap.GetBatch(keys);
+  std::vector<bool> contained = Multimap.ContainsBatch(keys);
+  ASSERT_EQ(values.size(), keys.size());
+  ASSERT_EQ(contained.size(), keys.size());
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(contained[i], Multimap.Contains(keys[i]));
+    if (Multimap.Contains(keys[i])) {
+      ASSERT_NE(values[i], nullptr);
+      EXPECT_EQ(*values[i], Multimap.Get(keys[i]));
+    } else {
+      EXPECT_EQ(values[i], nullptr);
+    }
+  }
+}
+
+TEST(Multimap, GetBatchEmpty) {
+  Multimap<int, int> Multimap;
+  std::vector<int> keys{1, 2, 3};
+  for (auto value : Multimap.GetBatch(keys))
+    EXPECT_EQ(value, nullptr);
+  EXPECT_TRUE(Multimap.GetBatch(std::vector<int>()).empty());
+}
+
+// TryGet() reports missing keys without throwing
+TEST(Multimap, TryGet) {
+  Multimap<int, int> Multimap;
+  EXPECT_EQ(Multimap.TryGet(1), nullptr);
+  Multimap.Insert(1, 10);
+  Multimap.Insert(1, 11);
+  ASSERT_NE(Multimap.TryGet(1), nullptr);
+  EXPECT_EQ(*Multimap.TryGet(1), 10);
+  Multimap.Remove(1);
+  EXPECT_EQ(*Multimap.TryGet(1), 11);
+  Multimap.Remove(1);
+  EXPECT_EQ(Multimap.TryGet(1), nullptr);
+}
+
+// The Bloom filter must never hide a present key, even across rebuilds
+TEST(Multimap, BloomFilter) {
+  Multimap<int, int> Multimap;
+  Multimap.Insert(-1, -1);
+  Multimap.EnableFilter(8);
+  EXPECT_EQ(Multimap.Contains(-1), true);
+  for (int i = 0; i < 1000; ++i) {
+    Multimap.Insert(i, i);
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    Multimap.Remove(i);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(Multimap.Contains(i), i % 2 == 1);
+    EXPECT_EQ(Multimap.TryGet(i) != nullptr, i % 2 == 1);
+  }
+  std::vector<int> keys{-1, 0, 1, 2, 3, 2000};
+  std::vector<bool> contained = Multimap.ContainsBatch(keys);
+  std::vector<bool> expected{true, false, true, false, true, false};
+  EXPECT_EQ(contained, expected);
+  EXPECT_THROW(Multimap.Get(2000), std::runtime_error);
+  Multimap.DisableFilter();
+  EXPECT_EQ(Multimap.Contains(999), true);
+  EXPECT_EQ(Multimap.Size(), 501);
+}
+
+// Test that the filter is sized by keys, not by the values they hold
+TEST(Multimap, BloomFilterManyValues) {
+  Multimap<int, int> Multimap;
+  Multimap.EnableFilter(8);
+  size_t bytes = Multimap.FilterBytes();
+  for (int i = 0; i < 100000; ++i) {
+    Multimap.Insert(i % 4, i);
+  }
+  EXPECT_EQ(Multimap.FilterBytes(), bytes);
+  for (int i = 0; i < 50000; ++i) {
+    Multimap.Remove(i % 4);
+  }
+  EXPECT_EQ(Multimap.FilterBytes(), bytes);
+  EXPECT_EQ(Multimap.Contains(3), true);
+  EXPECT_EQ(Multimap.Contains(4), false);
+  for (int i = 0; i < 100; ++i) {
+    Multimap.Insert(i, i);
+  }
+  EXPECT_LE(Multimap.FilterBytes(), 512);
+}
+
+// Finger insertion of nearly-sorted keys, mixed with removals
+TEST(Multimap, FingerInsert) {
+  Multimap<int, int> Multimap;
+  Multimap.SetFingerMode(true);
+  for (int i = 0; i < 500; ++i) {
+    // Every fifth key arrives slightly out of order
+    int key = i % 5 == 0 ? i - 3 : i;
+    Multimap.Insert(key, i);
+    if (i % 7 == 0)
+      Multimap.Remove(key);
+  }
+  Multimap.InsertHint(-10, 0);
+  Multimap.InsertHint(1000, 0);
+  EXPECT_EQ(Multimap.Min(), -10);
+  EXPECT_EQ(Multimap.Max(), 1000);
+
+  ::Multimap<int, int> expected;
+  for (int i = 0; i < 500; ++i) {
+    int key = i % 5 == 0 ? i - 3 : i;
+    expected.Insert(key, i);
+    if (i % 7 == 0)
+      expected.Remove(key);
+  }
+  EXPECT_EQ(Multimap.Size(), expected.Size() + 2);
+  for (int key = -5; key < 500; ++key) {
+    EXPECT_EQ(Multimap.Contains(key), expected.Contains(key));
+    if (expected.Contains(key)) {
+      EXPECT_EQ(Multimap.Get(key), expected.Get(key));
+    }
+  }
+}
+
+// String keys are ordered by their inline prefix, then in full on ties
+TEST(Multimap, StringKeys) {
+  Multimap<std::string, int> Multimap;
+  std::vector<std::string> keys{"", "a", "ab", std::string("ab\0c", 4),
+                                "abcdefgh", "abcdefgh1", "abcdefgh2",
+                                "abcdefghijklmnopqrstuvwxyz", "b", "\xff"};
+  std::vector<std::string> shuffled = keys;
+  std::random_shuffle(shuffled.begin(), shuffled.end());
+  for (unsigned i = 0; i < shuffled.size(); ++i) {
+    Multimap.Insert(shuffled[i], i);
+    Multimap.Insert(shuffled[i], i + 100);
+  }
+  EXPECT_EQ(Multimap.Size(), 20);
+  EXPECT_EQ(Multimap.Min(), "");
+  EXPECT_EQ(Multimap.Max(), "\xff");
+  for (unsigned i = 0; i < shuffled.size(); ++i) {
+    EXPECT_EQ(Multimap.Get(shuffled[i]), static_cast<int>(i));
+  }
+  EXPECT_EQ(Multimap.Contains("abcdefgh3"), false);
+  EXPECT_EQ(Multimap.Contains("abc"), false);
+  std::vector<bool> contained = Multimap.ContainsBatch(keys);
+  for (auto c : contained)
+    EXPECT_EQ(c, true);
+  for (auto &key : keys) {
+    Multimap.Remove(key);
+    Multimap.Remove(key);
+    EXPECT_EQ(Multimap.Contains(key), false);
+  }
+  EXPECT_EQ(Multimap.Size(), 0);
+}
+
+// Compaction relocates nodes without changing the contents
+TEST(Multimap, Compact) {
+  Multimap<int, int> Multimap;
+  Multimap.Compact();
+  for (int i = 0; i < 300; ++i) {
+    Multimap.Insert(i % 100, i);
+  }
+  for (int i = 0; i < 100; i += 4) {
+    Multimap.Remove(i);
+  }
+  Multimap.Compact();
+  EXPECT_EQ(Multimap.Size(), 275);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(Multimap.Get(i), i % 4 == 0 ? i + 100 : i);
+  }
+  // The tree stays mutable after compaction
+  Multimap.Insert(1000, 1);
+  Multimap.Remove(1);
+  EXPECT_EQ(Multimap.Max(), 1000);
+  EXPECT_EQ(Multimap.Get(1), 101);
+}
+
+// Incremental compaction interleaved with mutations
+TEST(Multimap, CompactStep) {
+  Multimap<int, int> Multimap;
+  for (int i = 0; i < 200; ++i) {
+    Multimap.Insert(i, i);
+  }
+  int steps = 0;
+  while (!Multimap.CompactStep(16)) {
+    ++steps;
+    Multimap.Insert(200 + steps, steps);
+    Multimap.Remove(steps);
+  }
+  EXPECT_GT(steps, 0);
+  EXPECT_EQ(Multimap.Size(), 200);
+  EXPECT_EQ(Multimap.Contains(0), true);
+  for (int i = 1; i <= steps; ++i) {
+    EXPECT_EQ(Multimap.Contains(i), false);
+    EXPECT_EQ(Multimap.Get(200 + i), i);
+  }
+}
+
+// Lazy removal leaves tombstones that lookups and Min()/Max() skip
+TEST(Multimap, LazyRemove) {
+  Multimap<int, int> Multimap;
+  Multimap.SetLazyRemove(true);
+  for (int i = 0; i < 20; ++i) {
+    Multimap.Insert(i, i);
+    Multimap.Insert(i, i + 100);
+  }
+  Multimap.Remove(0);
+  Multimap.Remove(0);
+  Multimap.Remove(19);
+  Multimap.Remove(19);
+  Multimap.Remove(5);
+  EXPECT_EQ(Multimap.Size(), 35);
+  EXPECT_EQ(Multimap.Min(), 1);
+  EXPECT_EQ(Multimap.Max(), 18);
+  EXPECT_EQ(Multimap.Contains(0), false);
+  EXPECT_EQ(Multimap.Get(5), 105);
+  // Inserting a removed key revives its tombstone
+  Multimap.Insert(0, 7);
+  EXPECT_EQ(Multimap.Min(), 0);
+  EXPECT_EQ(Multimap.Get(0), 7);
+  Multimap.Purge();
+  EXPECT_EQ(Multimap.Size(), 36);
+  EXPECT_EQ(Multimap.Max(), 18);
+}
+
+// Test range removal with and without lazy removal
+TEST(Multimap, RemoveRange) {
+  for (int lazy = 0; lazy < 2; ++lazy) {
+    Multimap<int, int> Multimap;
+    Multimap.SetLazyRemove(lazy);
+    for (int i = 0; i < 100; ++i) {
+      Multimap.Insert(i, i);
+      Multimap.Insert(i, -i);
+    }
+    Multimap.RemoveRange(10, 19);
+    EXPECT_EQ(Multimap.Size(), 180);
+    Multimap.RemoveRange(0, 59);
+    EXPECT_EQ(Multimap.Size(), 80);
+    EXPECT_EQ(Multimap.Min(), 60);
+    Multimap.RemoveRange(95, 1000);
+    EXPECT_EQ(Multimap.Max(), 94);
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_EQ(Multimap.Contains(i), i >= 60 && i < 95);
+    }
+    Multimap.SetLazyRemove(false);
+    EXPECT_EQ(Multimap.Size(), 70);
+    EXPECT_EQ(Multimap.Get(70), 70);
+  }
+}
+
+// Copies are deep and independent, moves hand over the nodes
+TEST(Multimap, CopyAndMove) {
+  Multimap<int, int> Multimap;
+  Multimap.SetLazyRemove(true);
+  for (int i = 0; i < 100; ++i) {
+    Multimap.Insert(i, i);
+    Multimap.Insert(i, -i);
+  }
+  Multimap.Remove(3);
+  Multimap.Remove(3);
+
+  ::Multimap<int, int> copy = Multimap.Clone();
+  EXPECT_EQ(copy.Size(), 198);
+  EXPECT_EQ(copy.Contains(3), false);
+  copy.Remove(4);
+  copy.Insert(1000, 0);
+  EXPECT_EQ(copy.Get(4), -4);
+  EXPECT_EQ(Multimap.Get(4), 4);
+  EXPECT_EQ(Multimap.Max(), 99);
+
+  ::Multimap<int, int> moved(std::move(copy));
+  EXPECT_EQ(copy.Size(), 0);
+  EXPECT_EQ(moved.Size(), 198);
+  EXPECT_EQ(moved.Max(), 1000);
+  moved.Insert(-1, -1);
+  EXPECT_EQ(moved.Min(), -1);
+
+  copy = moved;
+  moved.Clear();
+  EXPECT_EQ(moved.Size(), 0);
+  EXPECT_EQ(moved.Contains(5), false);
+  EXPECT_EQ(copy.Size(), 199);
+  EXPECT_EQ(copy.Get(5), 5);
+  copy = std::move(Multimap);
+  EXPECT_EQ(copy.Size(), 198);
+  EXPECT_EQ(copy.Max(), 99);
+}
+
+// Test the change feed and its resync fallback
+TEST(Multimap, ChangesSince) {
+  Multimap<int, int> Multimap;
+  std::vector<::Multimap<int, int>::Change> changes;
+  Multimap.Insert(1, 1);
+  EXPECT_EQ(Multimap.Version(), 1);
+  EXPECT_EQ(Multimap.ChangesSince(1, &changes), true);
+  EXPECT_EQ(Multimap.ChangesSince(0, &changes), false);
+
+  Multimap.EnableChangeLog(4);
+  Multimap.Insert(1, 2);
+  Multimap.Insert(2, 3);
+  Multimap.Remove(1);
+  EXPECT_EQ(Multimap.ChangesSince(2, &changes), true);
+  ASSERT_EQ(changes.size(), 2);
+  EXPECT_EQ(changes[0].version, 3);
+  EXPECT_EQ(changes[0].op, ChangeOp::kInsert);
+  EXPECT_EQ(changes[0].key, 2);
+  EXPECT_EQ(changes[1].op, ChangeOp::kRemove);
+  EXPECT_EQ(changes[1].key, 1);
+  EXPECT_EQ(changes[1].value, 1);
+
+  // The log only keeps the changes after version 2
+  Multimap.RemoveRange(0, 1);
+  Multimap.Insert(5, 5);
+  EXPECT_EQ(Multimap.Version(), 6);
+  changes.clear();
+  EXPECT_EQ(Multimap.ChangesSince(1, &changes), false);
+  EXPECT_EQ(Multimap.ChangesSince(2, &changes), true);
+  EXPECT_EQ(changes.size(), 4);
+
+  // Rebuild from a full scan after a resync
+  Multimap.Clear();
+  Multimap.Insert(4, 4);
+  Multimap.Insert(4, 5);
+  EXPECT_EQ(Multimap.ChangesSince(6, &changes), false);
+  std::vector<int> values;
+  Multimap.ForEach([&](int key, int value) { values.push_back(key + value); });
+  EXPECT_EQ(values, std::vector<int>({8, 9}));
+  changes.clear();
+  EXPECT_EQ(Multimap.ChangesSince(Multimap.Version() - 1, &changes), true);
+  EXPECT_EQ(changes.size(), 1);
+}
+
+// Test producers inserting and removing through the combining front end
+TEST(Multimap, CombiningProducers) {
+  CombiningMultimap<int, int> combining;
+  std::vector<std::thread> producers;
+  for (int t = 0; t < 8; ++t) {
+    producers.emplace_back([&combining, t] {
+      std::vector<std::future<void>> done;
+      for (int i = 0; i < 1000; ++i) {
+        done.push_back(combining.Insert(i, t));
+        // Every thread removes its own odd insertions again
+        if (i % 2)
+          done.push_back(combining.Remove(i));
+      }
+      for (auto &f : done)
+        f.get();
+      EXPECT_EQ(combining.Contains(998), true);
+    });
+  }
+  for (auto &t : producers)
+    t.join();
+
+  EXPECT_EQ(combining.Size(), 8 * 500);
+  EXPECT_EQ(combining.Contains(1), false);
+  combining.Insert(-1, 7);
+  combining.Flush();
+  EXPECT_EQ(combining.Get(-1), 7);
+  Multimap<int, int> snapshot = combining.Snapshot();
+  EXPECT_EQ(snapshot.Size(), 8 * 500 + 1);
+  EXPECT_EQ(snapshot.Max(), 998);
+}
+
+// Test that producers return while others keep the combiner busy
+TEST(Multimap, CombiningSustainedLoad) {
+  CombiningMultimap<int, int> combining;
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> producers;
+  for (int t = 0; t < 4; ++t) {
+    producers.emplace_back([&combining, &stop, t] {
+      while (!stop.load()) {
+        combining.Insert(t, t);
+        combining.Remove(t);
+      }
+    });
+  }
+  for (int i = 0; i < 200; ++i) {
+    std::future<void> done = combining.Insert(100 + i, i);
+    EXPECT_EQ(done.wait_for(std::chrono::seconds(0)),
+              std::future_status::ready);
+  }
+  stop.store(true);
+  for (auto &t : producers)
+    t.join();
+  combining.Flush();
+  EXPECT_EQ(combining.Size(), 200);
+  EXPECT_EQ(combining.Get(299), 199);
+}
+
+// Test the hot-key cache across removals and compaction
+TEST(Multimap, HotKeyCache) {
+  Multimap<int, int> Multimap;
+  Multimap.EnableHotKeyCache(64);
+  for (int i = 0; i < 1000; ++i) {
+    Multimap.Insert(i, i);
+  }
+  Multimap.Insert(7, 8);
+  for (int round = 0; round < 10; ++round) {
+    EXPECT_EQ(Multimap.Get(7), 7);
+    EXPECT_EQ(Multimap.Get(500), 500);
+  }
+  EXPECT_EQ(Multimap.CacheMisses(), 2);
+  EXPECT_EQ(Multimap.CacheHits(), 18);
+
+  // Removing a key, or the successor copied into its node, uncaches it
+  Multimap.Remove(7);
+  EXPECT_EQ(Multimap.Get(7), 8);
+  Multimap.Remove(7);
+  EXPECT_EQ(Multimap.Contains(7), false);
+  Multimap.Remove(499);
+  EXPECT_EQ(Multimap.Get(500), 500);
+  Multimap.RemoveRange(500, 510);
+  EXPECT_EQ(Multimap.Contains(500), false);
+
+  // Relocated nodes are uncached too
+  EXPECT_EQ(Multimap.Get(600), 600);
+  Multimap.Compact();
+  EXPECT_EQ(Multimap.Get(600), 600);
+  Multimap.Clear();
+  EXPECT_EQ(Multimap.Contains(600), false);
+}
+
+// Test promotion to a tree past N values and demotion below N / 2
+TEST(Multimap, SmallMultimap) {
+  SmallMultimap<int, int, 8> small;
+  for (int i = 0; i < 8; ++i) {
+    small.Insert(i % 4, i);
+  }
+  EXPECT_EQ(small.Promoted(), false);
+  EXPECT_EQ(small.Get(1), 1);
+  small.Remove(1);
+  EXPECT_EQ(small.Get(1), 5);
+  small.Insert(1, 9);
+  small.Insert(6, 6);
+  EXPECT_EQ(small.Promoted(), true);
+  EXPECT_EQ(small.Size(), 9);
+  EXPECT_EQ(small.Max(), 6);
+
+  // Demote at 3 values, which keep their order
+  for (int key : {0, 0, 2, 2, 6, 3}) {
+    small.Remove(key);
+  }
+  EXPECT_EQ(small.Promoted(), false);
+  std::vector<int> values;
+  small.ForEach([&](int, int value) { values.push_back(value); });
+  EXPECT_EQ(values, std::vector<int>({5, 9, 7}));
+  EXPECT_EQ(small.Min(), 1);
+}
+
+// Test a CSV round trip through buffers smaller than the output
+TEST(Multimap, ExportImport) {
+  Multimap<std::string, std::string> Multimap;
+  Multimap.Insert("b", "plain");
+  Multimap.Insert("a,b", "say \"hi\"");
+  Multimap.Insert("b", "two\nlines");
+  Multimap.Insert("", "");
+  std::stringstream stream;
+  char buffer[24];
+  BufferedWriter writer(stream, buffer, sizeof(buffer));
+  Multimap.ExportTo(writer);
+  EXPECT_EQ(stream.str(), ",\n\"a,b\",\"say \"\"hi\"\"\"\n"
+                          "b,plain\nb,\"two\nlines\"\n");
+
+  ::Multimap<std::string, std::string> imported;
+  BufferedReader reader(stream, buffer, sizeof(buffer));
+  imported.ImportFrom(reader);
+  EXPECT_EQ(imported.Size(), 4);
+  EXPECT_EQ(imported.Get("a,b"), "say \"hi\"");
+  imported.Remove("b");
+  EXPECT_EQ(imported.Get("b"), "two\nlines");
+
+  std::stringstream malformed("1,2\n3\n");
+  ::Multimap<int, int> numbers;
+  BufferedReader numbers_reader(malformed, buffer, sizeof(buffer));
+  EXPECT_THROW(numbers.ImportFrom(numbers_reader), std::runtime_error);
+  EXPECT_EQ(numbers.Get(1), 2);
+}
+
+// Key with ordering and equality but no std::hash
+struct Point {
+  int x, y;
+  bool operator<(const Point &other) const {
+    return x < other.x || (x == other.x && y < other.y);
+  }
+  bool operator==(const Point &other) const {
+    return x == other.x && y == other.y;
+  }
+  bool operator>(const Point &other) const { return other < *this; }
+};
+
+// Test that the hashed structures stay off for keys without std::hash
+TEST(Multimap, UnhashableKeys) {
+  Multimap<Point, int> Multimap;
+  Multimap.EnableFilter(16);
+  Multimap.EnableHotKeyCache(16);
+  for (int i = 0; i < 20; ++i) {
+    Multimap.Insert(Point{i % 5, i}, i);
+  }
+  EXPECT_EQ(Multimap.Get(Point{3, 8}), 8);
+  EXPECT_EQ(Multimap.Contains(Point{3, 9}), false);
+  Multimap.Remove(Point{3, 8});
+  EXPECT_EQ(Multimap.Contains(Point{3, 8}), false);
+  EXPECT_EQ(Multimap.CacheHits() + Multimap.CacheMisses(), 0);
+}
+
+// Test that a tree only makes room for its optional features once used
+TEST(Multimap, PlainTreeSize) {
+  EXPECT_LE(sizeof(Multimap<int, int>), 4 * sizeof(void*));
+  Multimap<int, int> Multimap;
+  std::vector<::Multimap<int, int>::Change> changes;
+  for (int i = 0; i < 10; ++i) {
+    Multimap.Insert(i % 5, i);
+  }
+  EXPECT_EQ(Multimap.Version(), 10);
+  EXPECT_EQ(Multimap.ChangesSince(10, &changes), true);
+  EXPECT_EQ(Multimap.ChangesSince(9, &changes), false);
+
+  // Features enabled later pick up the current tree and version
+  Multimap.EnableFilter(16);
+  Multimap.EnableChangeLog(4);
+  EXPECT_EQ(Multimap.ChangesSince(10, &changes), true);
+  Multimap.Remove(2);
+  EXPECT_EQ(Multimap.ChangesSince(10, &changes), true);
+  EXPECT_EQ(changes.size(), 1);
+  EXPECT_EQ(Multimap.Get(2), 7);
+  EXPECT_EQ(Multimap.Contains(7), false);
+  ::Multimap<int, int> copy = Multimap.Clone();
+  EXPECT_EQ(copy.Size(), 9);
+  EXPECT_EQ(copy.Get(4), 4);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,53 @@
+#ifndef NODE_ARENA_H_
+#define NODE_ARENA_H_
+
+#include <functional>
+#include <memory>
+
+// Fixed-capacity block of contiguous storage that tree nodes are relocated
+// into by Compact(). The arena only hands out memory: nodes are constructed
+// and destroyed in place by the tree, and must all be gone before the arena
+// itself is destroyed.
+template <typename Node>
+class NodeArena {
+ public:
+  explicit NodeArena(unsigned int capacity);
+  ~NodeArena();
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+
+  // Return storage for one more node, nullptr when the arena is full
+  void* Allocate();
+  // Return whether @n lives in this arena
+  bool Owns(const Node *n) const;
+
+ private:
+  std::allocator<Node> allocator;
+  Node *storage;
+  unsigned int used = 0;
+  unsigned int capacity;
+};
+
+template <typename Node>
+NodeArena<Node>::NodeArena(unsigned int capacity)
+    : storage(allocator.allocate(capacity)), capacity(capacity) {}
+
+template <typename Node>
+NodeArena<Node>::~NodeArena() {
+  allocator.deallocate(storage, capacity);
+}
+
+template <typename Node>
+void* NodeArena<Node>::Allocate() {
+  if (used == capacity)
+    return nullptr;
+  return storage + used++;
+}
+
+template <typename Node>
+bool NodeArena<Node>::Owns(const Node *n) const {
+  std::less<const Node*> less;
+  return !less(n, storage) && less(n, storage + capacity);
+}
+
+#endif  // NODE_ARENA_H_
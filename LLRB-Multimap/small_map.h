@@ -0,0 +1,452 @@
+#ifndef SMALL_MAP_H_
+#define SMALL_MAP_H_
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "map.h"
+#include "multimap.h"
+
+// Map that keeps up to @N entries in inline sorted arrays and only builds a
+// Map once it grows past them. Lookups in the arrays scan every key without
+// branching, which compilers vectorize for arithmetic keys. The tree is
+// dropped again when it shrinks below @N / 2, so a size hovering around @N
+// does not convert back and forth. K and V must be default constructible.
+template <typename K, typename V, unsigned int N = 16>
+class SmallMap {
+ public:
+  SmallMap() = default;
+  SmallMap(const SmallMap &other);
+  SmallMap(SmallMap &&other) = default;
+  SmallMap& operator=(const SmallMap &other);
+  SmallMap& operator=(SmallMap &&other) = default;
+  // Return whether the entries live in a Map rather than inline
+  bool Promoted() const;
+  // Remove every key
+  void Clear();
+  // Return number of keys
+  unsigned int Size();
+  // Return value associated to @key
+  const V& Get(const K &key);
+  // Return pointer to value associated to @key, nullptr if not found
+  const V* TryGet(const K &key);
+  // Return whether @key is found
+  bool Contains(const K &key);
+  // Return max key
+  const K& Max();
+  // Return min key
+  const K& Min();
+  // Insert @key
+  void Insert(const K &key, const V &value);
+  // Remove @key
+  void Remove(const K &key);
+  // Call @visit on every key and value in order
+  template <typename F>
+  void ForEach(F visit);
+  // Print keys in order
+  void Print();
+
+ private:
+  unsigned int count = 0;
+  K keys[N];
+  V values[N];
+  std::unique_ptr<Map<K, V>> tree;
+
+  unsigned int LowerBound(const K &key) const;
+  void Promote();
+  void Demote();
+};
+
+// Multimap counterpart of SmallMap, holding up to @N values inline
+template <typename K, typename V, unsigned int N = 16>
+class SmallMultimap {
+ public:
+  SmallMultimap() = default;
+  SmallMultimap(const SmallMultimap &other);
+  SmallMultimap(SmallMultimap &&other) = default;
+  SmallMultimap& operator=(const SmallMultimap &other);
+  SmallMultimap& operator=(SmallMultimap &&other) = default;
+  // Return whether the values live in a Multimap rather than inline
+  bool Promoted() const;
+  // Remove every value
+  void Clear();
+  // Return number of values
+  unsigned int Size();
+  // Return first value associated to @key
+  const V& Get(const K &key);
+  // Return pointer to first value associated to @key, nullptr if not found
+  const V* TryGet(const K &key);
+  // Return whether @key is found
+  bool Contains(const K &key);
+  // Return max key
+  const K& Max();
+  // Return min key
+  const K& Min();
+  // Insert @value after the values already associated to @key
+  void Insert(const K &key, const V &value);
+  // Remove first value associated to @key
+  void Remove(const K &key);
+  // Call @visit on every key and each of its values in order
+  template <typename F>
+  void ForEach(F visit);
+  // Print keys and their values in order
+  void Print();
+
+ private:
+  unsigned int count = 0;
+  K keys[N];
+  V values[N];
+  std::unique_ptr<Multimap<K, V>> tree;
+
+  unsigned int LowerBound(const K &key) const;
+  unsigned int UpperBound(const K &key) const;
+  void Promote();
+  void Demote();
+};
+
+template <typename K, typename V, unsigned int N>
+SmallMap<K, V, N>::SmallMap(const SmallMap &other) : count(other.count) {
+  for (unsigned int i = 0; i < count; ++i) {
+    keys[i] = other.keys[i];
+    values[i] = other.values[i];
+  }
+  if (other.tree)
+    tree.reset(new Map<K, V>(*other.tree));
+}
+
+template <typename K, typename V, unsigned int N>
+SmallMap<K, V, N>& SmallMap<K, V, N>::operator=(const SmallMap &other) {
+  if (this != &other)
+    *this = SmallMap(other);
+  return *this;
+}
+
+template <typename K, typename V, unsigned int N>
+bool SmallMap<K, V, N>::Promoted() const {
+  return tree != nullptr;
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMap<K, V, N>::Clear() {
+  for (unsigned int i = 0; i < count; ++i) {
+    keys[i] = K();
+    values[i] = V();
+  }
+  count = 0;
+  tree.reset();
+}
+
+template <typename K, typename V, unsigned int N>
+unsigned int SmallMap<K, V, N>::Size() {
+  return tree ? tree->Size() : count;
+}
+
+template <typename K, typename V, unsigned int N>
+unsigned int SmallMap<K, V, N>::LowerBound(const K &key) const {
+  unsigned int pos = 0;
+  for (unsigned int i = 0; i < count; ++i)
+    pos += keys[i] < key;
+  return pos;
+}
+
+template <typename K, typename V, unsigned int N>
+const V& SmallMap<K, V, N>::Get(const K &key) {
+  const V *value = TryGet(key);
+  if (!value)
+    throw std::runtime_error("Error: cannot find key");
+  return *value;
+}
+
+template <typename K, typename V, unsigned int N>
+const V* SmallMap<K, V, N>::TryGet(const K &key) {
+  if (tree)
+    return tree->TryGet(key);
+  unsigned int pos = LowerBound(key);
+  if (pos == count || !(keys[pos] == key))
+    return nullptr;
+  return &values[pos];
+}
+
+template <typename K, typename V, unsigned int N>
+bool SmallMap<K, V, N>::Contains(const K &key) {
+  return TryGet(key) != nullptr;
+}
+
+template <typename K, typename V, unsigned int N>
+const K& SmallMap<K, V, N>::Max() {
+  return tree ? tree->Max() : keys[count - 1];
+}
+
+template <typename K, typename V, unsigned int N>
+const K& SmallMap<K, V, N>::Min() {
+  return tree ? tree->Min() : keys[0];
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMap<K, V, N>::Insert(const K &key, const V &value) {
+  if (!tree) {
+    unsigned int pos = LowerBound(key);
+    if (pos < count && keys[pos] == key)
+      throw std::runtime_error("Key already inserted");
+    if (count == N) {
+      Promote();
+    } else {
+      for (unsigned int i = count; i > pos; --i) {
+        keys[i] = std::move(keys[i - 1]);
+        values[i] = std::move(values[i - 1]);
+      }
+      keys[pos] = key;
+      values[pos] = value;
+      count++;
+      return;
+    }
+  }
+  tree->Insert(key, value);
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMap<K, V, N>::Remove(const K &key) {
+  if (tree) {
+    tree->Remove(key);
+    if (tree->Size() < N / 2)
+      Demote();
+    return;
+  }
+  unsigned int pos = LowerBound(key);
+  if (pos == count || !(keys[pos] == key))
+    return;
+  for (unsigned int i = pos + 1; i < count; ++i) {
+    keys[i - 1] = std::move(keys[i]);
+    values[i - 1] = std::move(values[i]);
+  }
+  count--;
+  keys[count] = K();
+  values[count] = V();
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMap<K, V, N>::Promote() {
+  // The keys are sorted, so every insertion appends through the finger
+  tree.reset(new Map<K, V>());
+  for (unsigned int i = 0; i < count; ++i) {
+    tree->InsertHint(keys[i], values[i]);
+    keys[i] = K();
+    values[i] = V();
+  }
+  count = 0;
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMap<K, V, N>::Demote() {
+  std::unique_ptr<Map<K, V>> old = std::move(tree);
+  old->ForEach([this](const K &key, const V &value) {
+    keys[count] = key;
+    values[count++] = value;
+  });
+}
+
+template <typename K, typename V, unsigned int N>
+template <typename F>
+void SmallMap<K, V, N>::ForEach(F visit) {
+  if (tree) {
+    tree->ForEach(visit);
+    return;
+  }
+  for (unsigned int i = 0; i < count; ++i)
+    visit(keys[i], values[i]);
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMap<K, V, N>::Print() {
+  if (tree) {
+    tree->Print();
+    return;
+  }
+  for (unsigned int i = 0; i < count; ++i)
+    std::cout << "<" << keys[i] << "," << values[i] << "> ";
+  std::cout << std::endl;
+}
+
+template <typename K, typename V, unsigned int N>
+SmallMultimap<K, V, N>::SmallMultimap(const SmallMultimap &other)
+    : count(other.count) {
+  for (unsigned int i = 0; i < count; ++i) {
+    keys[i] = other.keys[i];
+    values[i] = other.values[i];
+  }
+  if (other.tree)
+    tree.reset(new Multimap<K, V>(*other.tree));
+}
+
+template <typename K, typename V, unsigned int N>
+SmallMultimap<K, V, N>& SmallMultimap<K, V, N>::operator=(
+    const SmallMultimap &other) {
+  if (this != &other)
+    *this = SmallMultimap(other);
+  return *this;
+}
+
+template <typename K, typename V, unsigned int N>
+bool SmallMultimap<K, V, N>::Promoted() const {
+  return tree != nullptr;
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMultimap<K, V, N>::Clear() {
+  for (unsigned int i = 0; i < count; ++i) {
+    keys[i] = K();
+    values[i] = V();
+  }
+  count = 0;
+  tree.reset();
+}
+
+template <typename K, typename V, unsigned int N>
+unsigned int SmallMultimap<K, V, N>::Size() {
+  return tree ? tree->Size() : count;
+}
+
+template <typename K, typename V, unsigned int N>
+unsigned int SmallMultimap<K, V, N>::LowerBound(const K &key) const {
+  unsigned int pos = 0;
+  for (unsigned int i = 0; i < count; ++i)
+    pos += keys[i] < key;
+  return pos;
+}
+
+template <typename K, typename V, unsigned int N>
+unsigned int SmallMultimap<K, V, N>::UpperBound(const K &key) const {
+  unsigned int pos = 0;
+  for (unsigned int i = 0; i < count; ++i)
+    pos += !(key < keys[i]);
+  return pos;
+}
+
+template <typename K, typename V, unsigned int N>
+const V& SmallMultimap<K, V, N>::Get(const K &key) {
+  const V *value = TryGet(key);
+  if (!value)
+    throw std::runtime_error("Error: cannot find key");
+  return *value;
+}
+
+template <typename K, typename V, unsigned int N>
+const V* SmallMultimap<K, V, N>::TryGet(const K &key) {
+  if (tree)
+    return tree->TryGet(key);
+  unsigned int pos = LowerBound(key);
+  if (pos == count || !(keys[pos] == key))
+    return nullptr;
+  return &values[pos];
+}
+
+template <typename K, typename V, unsigned int N>
+bool SmallMultimap<K, V, N>::Contains(const K &key) {
+  return TryGet(key) != nullptr;
+}
+
+template <typename K, typename V, unsigned int N>
+const K& SmallMultimap<K, V, N>::Max() {
+  return tree ? tree->Max() : keys[count - 1];
+}
+
+template <typename K, typename V, unsigned int N>
+const K& SmallMultimap<K, V, N>::Min() {
+  return tree ? tree->Min() : keys[0];
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMultimap<K, V, N>::Insert(const K &key, const V &value) {
+  if (!tree) {
+    if (count == N) {
+      Promote();
+    } else {
+      // Keep the values of @key in insertion order
+      unsigned int pos = UpperBound(key);
+      for (unsigned int i = count; i > pos; --i) {
+        keys[i] = std::move(keys[i - 1]);
+        values[i] = std::move(values[i - 1]);
+      }
+      keys[pos] = key;
+      values[pos] = value;
+      count++;
+      return;
+    }
+  }
+  tree->Insert(key, value);
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMultimap<K, V, N>::Remove(const K &key) {
+  if (tree) {
+    tree->Remove(key);
+    if (tree->Size() < N / 2)
+      Demote();
+    return;
+  }
+  unsigned int pos = LowerBound(key);
+  if (pos == count || !(keys[pos] == key))
+    return;
+  for (unsigned int i = pos + 1; i < count; ++i) {
+    keys[i - 1] = std::move(keys[i]);
+    values[i - 1] = std::move(values[i]);
+  }
+  count--;
+  keys[count] = K();
+  values[count] = V();
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMultimap<K, V, N>::Promote() {
+  // The keys are sorted, so every insertion appends through the finger
+  tree.reset(new Multimap<K, V>());
+  for (unsigned int i = 0; i < count; ++i) {
+    tree->InsertHint(keys[i], values[i]);
+    keys[i] = K();
+    values[i] = V();
+  }
+  count = 0;
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMultimap<K, V, N>::Demote() {
+  std::unique_ptr<Multimap<K, V>> old = std::move(tree);
+  old->ForEach([this](const K &key, const V &value) {
+    keys[count] = key;
+    values[count++] = value;
+  });
+}
+
+template <typename K, typename V, unsigned int N>
+template <typename F>
+void SmallMultimap<K, V, N>::ForEach(F visit) {
+  if (tree) {
+    tree->ForEach(visit);
+    return;
+  }
+  for (unsigned int i = 0; i < count; ++i)
+    visit(keys[i], values[i]);
+}
+
+template <typename K, typename V, unsigned int N>
+void SmallMultimap<K, V, N>::Print() {
+  if (tree) {
+    tree->Print();
+    return;
+  }
+  for (unsigned int i = 0; i < count; ++i) {
+    // Group the values of each key like Multimap::Print()
+    if (i == 0 || !(keys[i - 1] == keys[i]))
+      std::cout << "<" << keys[i] << ",";
+    else
+      std::cout << " ";
+    std::cout << values[i];
+    if (i + 1 == count || !(keys[i] == keys[i + 1]))
+      std::cout << "> \n";
+  }
+  std::cout << std::flush;
+}
+
+#endif  // SMALL_MAP_H_
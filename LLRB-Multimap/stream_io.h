@@ -0,0 +1,264 @@
+#ifndef STREAM_IO_H_
+#define STREAM_IO_H_
+
+#include <charconv>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+
+// Collects output in a caller-supplied buffer and hands it to the stream in
+// one write whenever the buffer fills up, instead of once per record.
+class BufferedWriter {
+ public:
+  BufferedWriter(std::ostream &out, char *buffer, size_t capacity);
+  BufferedWriter(const BufferedWriter&) = delete;
+  BufferedWriter& operator=(const BufferedWriter&) = delete;
+  ~BufferedWriter();
+
+  // Append @c to the output
+  void Put(char c);
+  // Append @size bytes at @data to the output
+  void Append(const char *data, size_t size);
+  // Write the buffered output to the stream and flush it
+  void Flush();
+
+ private:
+  std::ostream &out;
+  char *buffer;
+  size_t capacity;
+  size_t used = 0;
+
+  void Drain();
+};
+
+// Reads the stream in chunks as large as a caller-supplied buffer and splits
+// them into CSV records without copying them. A record must fit in the
+// buffer.
+class BufferedReader {
+ public:
+  BufferedReader(std::istream &in, char *buffer, size_t capacity);
+  BufferedReader(const BufferedReader&) = delete;
+  BufferedReader& operator=(const BufferedReader&) = delete;
+
+  // Point @line at the next record, without its newline, until the next
+  // call. Return false at the end of the stream
+  bool ReadLine(std::string_view *line);
+
+ private:
+  std::istream &in;
+  char *buffer;
+  size_t capacity;
+  size_t begin = 0;
+  size_t end = 0;
+  bool eof = false;
+};
+
+// Split the CSV record @line into its first field and the rest of the
+// record, return false when @line holds no separator
+inline bool SplitRecord(std::string_view line, std::string_view *first,
+                        std::string_view *rest);
+
+// Formatting of keys and values as CSV fields. Numbers use std::to_chars()
+// and std::from_chars(), which round-trip exactly and never touch a locale.
+// Strings are quoted only when they hold a separator, a quote or a newline.
+// Any other type goes through its stream operators.
+template <typename T, typename Enable = void>
+struct CsvField {
+  static void Write(BufferedWriter &writer, const T &value);
+  // Return false when @field does not hold a value
+  static bool Parse(std::string_view field, T *value);
+};
+
+template <>
+struct CsvField<std::string> {
+  static void Write(BufferedWriter &writer, const std::string &value);
+  static bool Parse(std::string_view field, std::string *value);
+};
+
+template <typename T>
+struct CsvField<T, typename std::enable_if<
+    std::is_floating_point<T>::value ||
+    (std::is_integral<T>::value && !std::is_same<T, bool>::value)>::type> {
+  static void Write(BufferedWriter &writer, const T &value);
+  static bool Parse(std::string_view field, T *value);
+};
+
+inline BufferedWriter::BufferedWriter(std::ostream &out, char *buffer,
+                                      size_t capacity)
+    : out(out), buffer(buffer), capacity(capacity) {}
+
+inline BufferedWriter::~BufferedWriter() {
+  Flush();
+}
+
+inline void BufferedWriter::Put(char c) {
+  if (used == capacity)
+    Drain();
+  buffer[used++] = c;
+}
+
+inline void BufferedWriter::Append(const char *data, size_t size) {
+  if (capacity - used < size) {
+    Drain();
+    // Too large to buffer, write it through
+    if (size > capacity) {
+      out.write(data, size);
+      return;
+    }
+  }
+  std::memcpy(buffer + used, data, size);
+  used += size;
+}
+
+inline void BufferedWriter::Flush() {
+  Drain();
+  out.flush();
+}
+
+inline void BufferedWriter::Drain() {
+  out.write(buffer, used);
+  used = 0;
+}
+
+inline BufferedReader::BufferedReader(std::istream &in, char *buffer,
+                                      size_t capacity)
+    : in(in), buffer(buffer), capacity(capacity) {}
+
+inline bool BufferedReader::ReadLine(std::string_view *line) {
+  size_t scan = begin;
+  // Newlines inside a quoted field belong to the record
+  bool quoted = false;
+  for (;;) {
+    for (; scan < end; ++scan) {
+      if (buffer[scan] == '"') {
+        quoted = !quoted;
+      } else if (buffer[scan] == '\n' && !quoted) {
+        *line = std::string_view(buffer + begin, scan - begin);
+        begin = scan + 1;
+        return true;
+      }
+    }
+    if (eof) {
+      // The last record may lack its newline
+      if (begin == end)
+        return false;
+      *line = std::string_view(buffer + begin, end - begin);
+      begin = end;
+      return true;
+    }
+    if (begin == 0 && end == capacity)
+      throw std::runtime_error("Error: record longer than buffer");
+    // Move the partial record to the front and refill behind it
+    std::memmove(buffer, buffer + begin, end - begin);
+    scan -= begin;
+    end -= begin;
+    begin = 0;
+    in.read(buffer + end, capacity - end);
+    size_t read = in.gcount();
+    end += read;
+    eof = read == 0;
+  }
+}
+
+inline bool SplitRecord(std::string_view line, std::string_view *first,
+                        std::string_view *rest) {
+  size_t pos = 0;
+  if (!line.empty() && line[0] == '"') {
+    // Skip the quoted field, its doubled quotes toggle twice
+    bool quoted = true;
+    for (pos = 1; pos < line.size() && (quoted || line[pos] != ','); ++pos) {
+      if (line[pos] == '"')
+        quoted = !quoted;
+    }
+  } else {
+    pos = line.find(',');
+  }
+  if (pos >= line.size())
+    return false;
+  *first = line.substr(0, pos);
+  *rest = line.substr(pos + 1);
+  return true;
+}
+
+template <typename T, typename Enable>
+void CsvField<T, Enable>::Write(BufferedWriter &writer, const T &value) {
+  std::ostringstream out;
+  out << value;
+  CsvField<std::string>::Write(writer, out.str());
+}
+
+template <typename T, typename Enable>
+bool CsvField<T, Enable>::Parse(std::string_view field, T *value) {
+  std::string text;
+  if (!CsvField<std::string>::Parse(field, &text))
+    return false;
+  std::istringstream in(text);
+  in >> *value;
+  return !in.fail() && in.peek() == std::char_traits<char>::eof();
+}
+
+inline void CsvField<std::string>::Write(BufferedWriter &writer,
+                                         const std::string &value) {
+  if (value.find_first_of(",\"\n\r") == std::string::npos) {
+    writer.Append(value.data(), value.size());
+    return;
+  }
+  writer.Put('"');
+  for (char c : value) {
+    if (c == '"')
+      writer.Put('"');
+    writer.Put(c);
+  }
+  writer.Put('"');
+}
+
+inline bool CsvField<std::string>::Parse(std::string_view field,
+                                         std::string *value) {
+  if (field.empty() || field[0] != '"') {
+    value->assign(field.data(), field.size());
+    return true;
+  }
+  if (field.size() < 2 || field.back() != '"')
+    return false;
+  value->clear();
+  for (size_t i = 1; i + 1 < field.size(); ++i) {
+    // A quote inside the field must be doubled
+    if (field[i] == '"') {
+      if (i + 2 >= field.size() || field[i + 1] != '"')
+        return false;
+      ++i;
+    }
+    value->push_back(field[i]);
+  }
+  return true;
+}
+
+template <typename T>
+void CsvField<T, typename std::enable_if<
+    std::is_floating_point<T>::value ||
+    (std::is_integral<T>::value && !std::is_same<T, bool>::value)>::type>::
+    Write(BufferedWriter &writer, const T &value) {
+  // Enough for any integer and for the shortest form of any double
+  char text[64];
+  std::to_chars_result result = std::to_chars(text, text + sizeof(text),
+                                              value);
+  writer.Append(text, result.ptr - text);
+}
+
+template <typename T>
+bool CsvField<T, typename std::enable_if<
+    std::is_floating_point<T>::value ||
+    (std::is_integral<T>::value && !std::is_same<T, bool>::value)>::type>::
+    Parse(std::string_view field, T *value) {
+  const char *last = field.data() + field.size();
+  std::from_chars_result result = std::from_chars(field.data(), last, *value);
+  return result.ec == std::errc() && result.ptr == last;
+}
+
+#endif  // STREAM_IO_H_
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
+#include <sstream>
+#include <string>
 #include <vector>
 
 #include "map.h"
+#include "small_map.h"
 #include <algorithm>
 
 // Test one key
@@ -35,6 +38,286 @@ TEST(Map, MultipleKeys) {
   }
 }
 
+// Test batched lookups
+TEST(Map, GetBatch) {
+  Map<int, int> map;
+  for (int i = 0; i < 50; ++i) {
+    map.Insert(i * 3, i);
+  }
+
+  std::vector<int> keys;
+  for (int i = 0; i < 150; ++i)
+    keys.push_back(i);
+  std::vector<const int*> values = map.GetBatch(keys);
+  std::vector<bool> contained = map.ContainsBatch(keys);
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(contained[i], keys[i] % 3 == 0);
+    if (keys[i] % 3 == 0)
+      EXPECT_EQ(*values[i], keys[i] / 3);
+    else
+      EXPECT_EQ(values[i], nullptr);
+  }
+}
+
+// Test lookups through the Bloom filter
+TEST(Map, BloomFilter) {
+  Map<int, int> map;
+  map.EnableFilter(100);
+  for (int i = 0; i < 100; ++i) {
+    map.Insert(i, i);
+  }
+  for (int i = 0; i < 100; i += 3) {
+    map.Remove(i);
+  }
+  for (int i = -100; i < 200; ++i) {
+    bool present = i >= 0 && i < 100 && i % 3 != 0;
+    EXPECT_EQ(map.Contains(i), present);
+    EXPECT_EQ(map.TryGet(i) != nullptr, present);
+  }
+}
+
+// Test finger insertion of ascending and descending keys
+TEST(Map, FingerInsert) {
+  Map<int, int> map;
+  for (int i = 0; i < 200; ++i) {
+    map.InsertHint(i, i);
+  }
+  for (int i = -1; i > -200; --i) {
+    map.InsertHint(i, i);
+  }
+  EXPECT_THROW(map.InsertHint(100, 0), std::runtime_error);
+  EXPECT_EQ(map.Size(), 399);
+  EXPECT_EQ(map.Min(), -199);
+  EXPECT_EQ(map.Max(), 199);
+  for (int i = -199; i < 200; ++i) {
+    EXPECT_EQ(map.Get(i), i);
+  }
+}
+
+// Test lookups after compaction
+TEST(Map, Compact) {
+  Map<std::string, int> map;
+  for (int i = 0; i < 100; ++i) {
+    map.Insert(std::to_string(i), i);
+  }
+  for (int i = 0; i < 100; i += 2) {
+    map.Remove(std::to_string(i));
+  }
+  map.Compact();
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(map.Contains(std::to_string(i)), i % 2 == 1);
+  }
+  map.Insert("x", -1);
+  EXPECT_EQ(map.Max(), "x");
+  EXPECT_EQ(map.Size(), 51);
+}
+
+// Test lazy removal and range removal
+TEST(Map, LazyRemove) {
+  Map<int, int> map;
+  map.SetLazyRemove(true);
+  for (int i = 0; i < 100; ++i) {
+    map.Insert(i, i);
+  }
+  for (int i = 0; i < 100; i += 2) {
+    map.Remove(i);
+  }
+  map.RemoveRange(80, 200);
+  EXPECT_EQ(map.Size(), 40);
+  EXPECT_EQ(map.Min(), 1);
+  EXPECT_EQ(map.Max(), 79);
+  map.Insert(90, -90);
+  EXPECT_EQ(map.Get(90), -90);
+  EXPECT_EQ(map.Contains(92), false);
+  EXPECT_THROW(map.Insert(1, 1), std::runtime_error);
+}
+
+// Test copies of a large tree
+TEST(Map, Clone) {
+  Map<int, int> map;
+  map.SetFingerMode(true);
+  for (int i = 0; i < 100000; ++i) {
+    map.Insert(i, i);
+  }
+  Map<int, int> copy(map);
+  map.Clear();
+  EXPECT_EQ(map.Size(), 0);
+  EXPECT_EQ(copy.Size(), 100000);
+  for (int i = 0; i < 100000; i += 997) {
+    EXPECT_EQ(copy.Get(i), i);
+  }
+  map = std::move(copy);
+  EXPECT_EQ(map.Max(), 99999);
+  map.Insert(-1, 0);
+  EXPECT_EQ(map.Min(), -1);
+}
+
+// Test the change feed
+TEST(Map, ChangesSince) {
+  Map<int, int> map;
+  map.EnableChangeLog(16);
+  map.SetLazyRemove(true);
+  for (int i = 0; i < 10; ++i) {
+    map.Insert(i, i);
+  }
+  map.Remove(3);
+  map.RemoveRange(5, 6);
+  std::vector<Map<int, int>::Change> changes;
+  EXPECT_EQ(map.ChangesSince(10, &changes), true);
+  ASSERT_EQ(changes.size(), 3);
+  EXPECT_EQ(changes[0].key, 3);
+  EXPECT_EQ(changes[2].op, ChangeOp::kRemove);
+  EXPECT_EQ(changes[2].value, 6);
+  int sum = 0;
+  map.ForEach([&](int key, int) { sum += key; });
+  EXPECT_EQ(sum, 45 - 3 - 5 - 6);
+}
+
+// Test the hot-key cache with lazy removal
+TEST(Map, HotKeyCache) {
+  Map<int, int> map;
+  map.EnableHotKeyCache(16);
+  map.SetLazyRemove(true);
+  for (int i = 0; i < 100; ++i) {
+    map.Insert(i, i);
+  }
+  EXPECT_EQ(map.Get(42), 42);
+  EXPECT_EQ(map.Get(42), 42);
+  EXPECT_EQ(map.CacheHits(), 1);
+  map.Remove(42);
+  EXPECT_EQ(map.Contains(42), false);
+  map.Insert(42, 0);
+  EXPECT_EQ(map.Get(42), 0);
+  Map<int, int> copy(map);
+  map.Clear();
+  EXPECT_EQ(copy.Get(42), 0);
+  EXPECT_EQ(copy.Get(42), 0);
+  EXPECT_EQ(copy.CacheHits(), 3);
+}
+
+// Test the inline array and its promotion to a tree
+TEST(Map, SmallMap) {
+  SmallMap<std::string, int, 4> small;
+  for (int i = 3; i >= 0; --i) {
+    small.Insert(std::to_string(i), i);
+  }
+  EXPECT_THROW(small.Insert("2", 2), std::runtime_error);
+  EXPECT_EQ(small.Promoted(), false);
+  EXPECT_EQ(small.Min(), "0");
+  small.Insert("4", 4);
+  EXPECT_EQ(small.Promoted(), true);
+  SmallMap<std::string, int, 4> copy(small);
+  for (int i = 0; i < 4; ++i) {
+    small.Remove(std::to_string(i));
+  }
+  EXPECT_EQ(small.Promoted(), false);
+  EXPECT_EQ(small.Get("4"), 4);
+  EXPECT_EQ(small.Contains("0"), false);
+  EXPECT_EQ(copy.Size(), 5);
+  EXPECT_EQ(copy.Get("0"), 0);
+}
+
+// Test an exact round trip of numbers through CSV
+TEST(Map, ExportImport) {
+  Map<int, double> map;
+  for (int i = -500; i < 500; ++i) {
+    map.Insert(i, i / 3.0);
+  }
+  std::stringstream stream;
+  std::vector<char> buffer(1 << 12);
+  BufferedWriter writer(stream, buffer.data(), buffer.size());
+  map.ExportTo(writer);
+
+  Map<int, double> imported;
+  BufferedReader reader(stream, buffer.data(), buffer.size());
+  imported.ImportFrom(reader);
+  EXPECT_EQ(imported.Size(), 1000);
+  EXPECT_EQ(imported.Min(), -500);
+  for (int i = -500; i < 500; i += 7) {
+    EXPECT_EQ(imported.Get(i), i / 3.0);
+  }
+}
+
+// Key with ordering and equality but no std::hash
+struct Point {
+  int x, y;
+  bool operator<(const Point &other) const {
+    return x < other.x || (x == other.x && y < other.y);
+  }
+  bool operator==(const Point &other) const {
+    return x == other.x && y == other.y;
+  }
+  bool operator>(const Point &other) const { return other < *this; }
+};
+
+// Test that the hashed structures stay off for keys without std::hash
+TEST(Map, UnhashableKeys) {
+  Map<Point, int> map;
+  map.EnableFilter(16);
+  map.EnableHotKeyCache(16);
+  for (int i = 0; i < 20; ++i) {
+    map.Insert(Point{i % 5, i}, i);
+  }
+  EXPECT_EQ(map.Get(Point{3, 8}), 8);
+  EXPECT_EQ(map.Contains(Point{3, 9}), false);
+  std::vector<bool> found = map.ContainsBatch({Point{0, 0}, Point{0, 1}});
+  EXPECT_EQ(found, std::vector<bool>({true, false}));
+  EXPECT_EQ(map.CacheHits() + map.CacheMisses(), 0);
+}
+
+// Test that assigning over a tree forces its consumers to resync
+TEST(Map, ChangesSinceAssignment) {
+  Map<int, int> map;
+  Map<int, int> other;
+  map.EnableChangeLog(64);
+  for (int i = 0; i < 10; ++i) {
+    map.Insert(i, i);
+  }
+  other.EnableChangeLog(8);
+  other.Insert(100, 100);
+  unsigned long long seen = map.Version();
+  unsigned long long other_seen = other.Version();
+  map = other;
+  EXPECT_GT(map.Version(), seen);
+  for (int i = 0; i < 12; ++i) {
+    map.Insert(200 + i, i);
+  }
+  std::vector<Map<int, int>::Change> changes;
+  EXPECT_EQ(map.ChangesSince(seen, &changes), false);
+
+  map = std::move(other);
+  EXPECT_EQ(map.Size(), 1);
+  EXPECT_GT(other.Version(), other_seen);
+  EXPECT_EQ(other.ChangesSince(other_seen, &changes), false);
+  unsigned long long current = map.Version();
+  map.Insert(1, 1);
+  EXPECT_EQ(map.ChangesSince(current, &changes), true);
+  EXPECT_EQ(changes.size(), 1);
+}
+
+// Test that a tree only makes room for its optional features once used
+TEST(Map, PlainTreeSize) {
+  EXPECT_LE(sizeof(Map<int, int>), 4 * sizeof(void*));
+  Map<int, int> map;
+  std::vector<Map<int, int>::Change> changes;
+  for (int i = 0; i < 10; ++i) {
+    map.Insert(i, i);
+  }
+  EXPECT_EQ(map.ChangesSince(10, &changes), true);
+  EXPECT_EQ(map.ChangesSince(9, &changes), false);
+
+  // Features enabled later pick up the current tree and version
+  map.SetLazyRemove(true);
+  map.EnableChangeLog(4);
+  map.Remove(3);
+  EXPECT_EQ(map.ChangesSince(10, &changes), true);
+  EXPECT_EQ(changes.size(), 1);
+  EXPECT_EQ(map.Contains(3), false);
+  Map<int, int> copy = map.Clone();
+  EXPECT_EQ(copy.Size(), 9);
+  EXPECT_EQ(copy.Min(), 0);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();